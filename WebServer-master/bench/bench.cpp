@@ -0,0 +1,513 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-06
+ * @copyleft Apache 2.0
+ */
+/* 核心组件微基准：每项先预热，再重复多轮，输出每轮ns/op的中位数、MAD等统计量，结果写成JSON便于对比 */
+#include "../code/buffer/buffer.h"
+#include "../code/http/httprequest.h"
+#include "../code/http/httpresponse.h"
+#include "../code/http/httpscan.h"
+#include "../code/http/urlencoded.h"
+#include "../code/timer/heaptimer.h"
+#include "../code/pool/threadpool.h"
+#include "../code/log/log.h"
+#include "../code/metrics/histogram.h"
+#include "../code/store/mmapuserstore.h"
+#include "../code/server/ipfilter.h"
+#include <fstream>
+#include <arpa/inet.h>
+
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <cmath>
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;                   // 每轮操作数
+    std::vector<double> nsPerOp;    // 每轮的ns/op
+};
+
+struct BenchConfig {
+    int warmup = 2;
+    int reps = 15;
+    std::string filter;
+    std::string out = "bench.json";
+};
+
+static BenchConfig g_cfg;
+static std::vector<BenchResult> g_results;
+
+/* setup不计时，body执行ops次操作并计时 */
+static void Bench(const std::string& name, uint64_t ops,
+                  const std::function<void()>& setup,
+                  const std::function<void()>& body) {
+    if(!g_cfg.filter.empty() && name.find(g_cfg.filter) == std::string::npos) {
+        return;
+    }
+    BenchResult res;
+    res.name = name;
+    res.ops = ops;
+    for(int i = 0; i < g_cfg.warmup + g_cfg.reps; i++) {
+        if(setup) { setup(); }
+        uint64_t start = MonoNs();
+        body();
+        uint64_t ns = MonoNs() - start;
+        if(i >= g_cfg.warmup) {
+            res.nsPerOp.push_back(static_cast<double>(ns) / ops);
+        }
+    }
+    std::vector<double> v = res.nsPerOp;
+    std::sort(v.begin(), v.end());
+    fprintf(stderr, "%-48s %12.1f ns/op  (min %.1f, max %.1f)\n",
+            name.c_str(), v[v.size() / 2], v.front(), v.back());
+    g_results.push_back(std::move(res));
+}
+
+static double Median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void WriteJson(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if(!fp) {
+        fprintf(stderr, "cannot write %s\n", path.c_str());
+        return;
+    }
+    fprintf(fp, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"benchmarks\": [\n",
+            g_cfg.warmup, g_cfg.reps);
+    for(size_t i = 0; i < g_results.size(); i++) {
+        const BenchResult& r = g_results[i];
+        const std::vector<double>& v = r.nsPerOp;
+        double mean = 0, var = 0;
+        for(double x: v) { mean += x; }
+        mean /= v.size();
+        for(double x: v) { var += (x - mean) * (x - mean); }
+        double stddev = v.size() > 1 ? std::sqrt(var / (v.size() - 1)) : 0;
+        double median = Median(v);
+        std::vector<double> dev;
+        for(double x: v) { dev.push_back(std::fabs(x - median)); }
+        fprintf(fp, "    {\"name\": \"%s\", \"unit\": \"ns/op\", \"ops_per_rep\": %llu, "
+                    "\"median\": %.3f, \"mad\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, "
+                    "\"min\": %.3f, \"max\": %.3f, \"samples\": [",
+                r.name.c_str(), (unsigned long long)r.ops, median, Median(dev), mean, stddev,
+                *std::min_element(v.begin(), v.end()), *std::max_element(v.begin(), v.end()));
+        for(size_t j = 0; j < v.size(); j++) {
+            fprintf(fp, "%s%.3f", j ? ", " : "", v[j]);
+        }
+        fprintf(fp, "]}%s\n", i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+/* ---------------- Buffer ---------------- */
+static void BenchBuffer() {
+    const std::string small(64, 'a');
+    const std::string large(4096, 'b');
+    {
+        Buffer buff;
+        const int N = 100000;
+        Bench("Buffer::Append 64B", N, [&] { buff.RetrieveAll(); }, [&] {
+            for(int i = 0; i < N; i++) {
+                buff.Append(small.data(), small.size());
+                if(buff.ReadableBytes() > 60000) { buff.Retrieve(buff.ReadableBytes()); }
+            }
+        });
+    }
+    {
+        Buffer buff;
+        const int N = 20000;
+        Bench("Buffer::Append 4KiB", N, [&] { buff.RetrieveAll(); }, [&] {
+            for(int i = 0; i < N; i++) {
+                buff.Append(large.data(), large.size());
+                buff.Retrieve(large.size());
+            }
+        });
+    }
+    {
+        /* 读指针后移后追加，触发MakeSpace_的整理(前移)分支 */
+        Buffer buff(8192);
+        const int N = 20000;
+        Bench("Buffer::MakeSpace_ compact 4KiB", N, [&] { buff.RetrieveAll(); }, [&] {
+            for(int i = 0; i < N; i++) {
+                buff.Append(large.data(), large.size());
+                buff.Append(large.data(), 2048);
+                buff.Retrieve(large.size());
+                buff.Append(large.data(), 2048 + 1024);
+                buff.Retrieve(buff.ReadableBytes());
+            }
+        });
+    }
+    {
+        /* 从小缓冲开始不断追加，触发MakeSpace_的扩容分支 */
+        const int N = 200;
+        Bench("Buffer::MakeSpace_ grow to 1MiB", N, nullptr, [&] {
+            for(int i = 0; i < N; i++) {
+                Buffer buff(1024);
+                for(int j = 0; j < 256; j++) { buff.Append(large.data(), large.size()); }
+            }
+        });
+    }
+    {
+        int fds[2];
+        if(pipe(fds) == 0) {
+            Buffer buff;
+            const int N = 20000;
+            int err = 0;
+            Bench("Buffer::ReadFd 4KiB (incl. pipe write)", N, [&] { buff.RetrieveAll(); }, [&] {
+                for(int i = 0; i < N; i++) {
+                    if(::write(fds[1], large.data(), large.size()) < 0) { break; }
+                    buff.ReadFd(fds[0], &err);
+                    buff.Retrieve(buff.ReadableBytes());
+                }
+            });
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+}
+
+/* ---------------- HttpRequest ---------------- */
+static const char* REQUEST_CORPUS[] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1:1316\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/84.0.4147.89 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n\r\n",
+
+    "GET /images/profile-image.jpg HTTP/1.1\r\n"
+    "Host: 127.0.0.1:1316\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:79.0) Gecko/20100101 Firefox/79.0\r\n"
+    "Accept: image/webp,*/*\r\n"
+    "Referer: http://127.0.0.1:1316/picture.html\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1593000000; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n\r\n",
+
+    "GET /js/jquery.js HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept: */*\r\n"
+    "If-Modified-Since: Sat, 20 Jun 2020 08:00:00 GMT\r\n\r\n",
+
+    "POST /submit HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 47\r\n\r\n"
+    "username=mark%20park&password=p%40ss+word&x=%7E",
+};
+
+/* 分帧在HttpConn里做，不计入解析：请求头到第一个空行，其余都是请求体 */
+static size_t HeaderLen(const char* req, size_t len) {
+    static const char CRLF2[] = "\r\n\r\n";
+    return std::search(req, req + len, CRLF2, CRLF2 + 4) - req;
+}
+
+static void BenchHttpRequest() {
+    const int CORPUS = sizeof(REQUEST_CORPUS) / sizeof(REQUEST_CORPUS[0]);
+    const int N = 2000;
+    size_t headerLen[CORPUS];
+    for(int i = 0; i < CORPUS; i++) {
+        headerLen[i] = HeaderLen(REQUEST_CORPUS[i], strlen(REQUEST_CORPUS[i]));
+    }
+    Buffer buff;
+    HttpRequest request;
+    Bench("HttpRequest::parse corpus", N, nullptr, [&] {
+        for(int i = 0; i < N; i++) {
+            const char* req = REQUEST_CORPUS[i % CORPUS];
+            size_t len = strlen(req);
+            size_t h = headerLen[i % CORPUS];
+            buff.RetrieveAll();
+            buff.Append(req, len);
+            request.Init();
+            request.parse(buff, h, len - h - 4);
+        }
+    });
+}
+
+/* 长Cookie、长User-Agent和一串头部，定界符扫描占大头；每种CPU支持的扫描实现各跑一遍 */
+static void BenchHttpRequestHeavy() {
+    std::string req = "GET /images/profile-image.jpg?size=large&format=webp HTTP/1.1\r\n"
+                      "Host: www.example.com:1316\r\n"
+                      "Connection: keep-alive\r\n"
+                      "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+                      "(KHTML, like Gecko) Chrome/84.0.4147.105 Safari/537.36 Edg/84.0.522.52 "
+                      "OPR/70.0.3728.95 YaBrowser/20.7.3.100 Yowser/2.5\r\n";
+    const char* EXTRA[] = { "Accept", "Accept-Encoding", "Accept-Language", "Cache-Control",
+                            "Sec-Fetch-Site", "Sec-Fetch-Mode", "Sec-Fetch-Dest", "Referer",
+                            "X-Forwarded-For", "X-Request-Id", "If-None-Match", "DNT" };
+    for(const char* name : EXTRA) {
+        req += std::string(name) + ": " + std::string(48, 'v') + "\r\n";
+    }
+    req += "Cookie: ";
+    for(int i = 0; i < 24; i++) {
+        req += "_c" + std::to_string(i) + "=" + std::string(64, 'a' + i % 26) + "; ";
+    }
+    req += "session=8f14e45fceea167a5a36dedd4bea2543\r\n\r\n";
+
+    const int N = 2000;
+    size_t headerLen = HeaderLen(req.data(), req.size());
+    int original = HttpScan::Impl();
+    Buffer buff;
+    HttpRequest request;
+    for(int impl = HttpScan::SCALAR; impl <= HttpScan::AVX2; impl++) {
+        if(!HttpScan::UseImpl(impl)) { continue; }
+        std::string name = std::string("HttpRequest::parse header-heavy ") + HttpScan::ImplName(impl);
+        Bench(name, N, nullptr, [&] {
+            for(int i = 0; i < N; i++) {
+                buff.RetrieveAll();
+                buff.Append(req);
+                request.Init();
+                request.parse(buff, headerLen, req.size() - headerLen - 4);
+            }
+        });
+    }
+    HttpScan::UseImpl(original);
+}
+
+/* 40个字段的表单，值里夹着中文和符号的%XX转义；每轮先拷回原文再就地解码 */
+static void BenchUrlEncoded() {
+    std::string form;
+    for(int i = 0; i < 40; i++) {
+        if(i) { form += "&"; }
+        form += "field_" + std::to_string(i) + "=";
+        form += i % 4 == 0 ? "%E4%B8%AD%E6%96%87+text" : "plain_value_without_escapes_" + std::to_string(i);
+    }
+    const int N = 2000;
+    int original = HttpScan::Impl();
+    std::string body;
+    std::vector<UrlEncoded::Field> fields;
+    for(int impl = HttpScan::SCALAR; impl <= HttpScan::AVX2; impl++) {
+        if(!HttpScan::UseImpl(impl)) { continue; }
+        std::string name = std::string("UrlEncoded::Decode 40 fields ") + HttpScan::ImplName(impl);
+        Bench(name, N, nullptr, [&] {
+            for(int i = 0; i < N; i++) {
+                body.assign(form);
+                fields.clear();
+                UrlEncoded::Decode(&body[0], body.size(), &fields);
+            }
+        });
+    }
+    HttpScan::UseImpl(original);
+}
+
+/* ---------------- HttpResponse ---------------- */
+static std::string FindResources() {
+    const char* candidates[] = { "../resources/", "./resources/" };
+    struct stat st;
+    for(const char* dir: candidates) {
+        if(stat((std::string(dir) + "index.html").c_str(), &st) == 0) { return dir; }
+    }
+    return "";
+}
+
+static void BenchHttpResponse() {
+    std::string srcDir = FindResources();
+    if(srcDir.empty()) {
+        fprintf(stderr, "resources/ not found, skip HttpResponse\n");
+        return;
+    }
+    const int N = 20000;
+    HttpHead::UpdateDate();
+    Buffer buff;
+    HttpResponse response;
+    const char* paths[] = { "/index.html", "/nothing-here.html" };
+    const char* names[] = { "HttpResponse::MakeResponse 200", "HttpResponse::MakeResponse 404",
+                            "HttpResponse::MakeResponse 200 indexed", "HttpResponse::MakeResponse 404 indexed" };
+    /* 先逐个stat，再建好静态资源索引后查表 */
+    for(int k = 0; k < 4; k++) {
+        if(k == 2 && !StaticIndex::Instance()->Init(srcDir)) { break; }
+        std::string path;
+        Bench(names[k], N, nullptr, [&] {
+            for(int i = 0; i < N; i++) {
+                path = paths[k % 2];
+                buff.RetrieveAll();
+                response.Init(srcDir, path, true, 200);
+                response.MakeResponse(buff);
+                response.UnmapFile();
+            }
+        });
+    }
+    StaticIndex::Instance()->Close();
+}
+
+/* ---------------- UserStore ---------------- */
+/* 内嵌后端不依赖数据库服务，登录/注册路径可以在CI里跑 */
+static void BenchUserStore() {
+    const int N = 100000;
+    const char* path = "./bench_user.db";
+    std::vector<std::string> names(N);
+    for(int i = 0; i < N; i++) { names[i] = "user" + std::to_string(i); }
+    std::unique_ptr<MmapUserStore> store;
+    Bench("MmapUserStore::Register n=100000", N, [&] {
+        store.reset();
+        unlink(path);
+        store.reset(new MmapUserStore());
+        store->Open(path);
+    }, [&] {
+        for(int i = 0; i < N; i++) { store->Register(names[i], "password"); }
+    });
+    if(!store) { return; }
+    std::mt19937 rng(42);
+    std::vector<int> order(N);
+    for(int i = 0; i < N; i++) { order[i] = rng() % N; }
+    Bench("MmapUserStore::Login hit", N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { store->Login(names[order[i]], "password"); }
+    });
+    std::string missing = "nobody";
+    Bench("MmapUserStore::Login miss", N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { store->Login(missing, "password"); }
+    });
+    store.reset();
+    unlink(path);
+}
+
+/* ---------------- IpFilter ---------------- */
+/* 10万条/16~/32的随机前缀，随机地址查询 */
+static void BenchIpFilter() {
+    const int RULES = 100000, N = 1000000;
+    const char* path = "./bench_filter.conf";
+    std::mt19937 rng(42);
+    {
+        std::ofstream out(path);
+        for(int i = 0; i < RULES; i++) {
+            uint32_t a = rng();
+            out << (i % 2 ? "allow " : "deny ") << (a >> 24) << '.' << ((a >> 16) & 0xff) << '.'
+                << ((a >> 8) & 0xff) << '.' << (a & 0xff) << '/' << 16 + rng() % 17 << '\n';
+        }
+    }
+    IpFilter* filter = IpFilter::Instance();
+    Bench("IpFilter::Load rules=100000", RULES, nullptr, [&] { filter->Load(path); });
+    std::vector<in_addr_t> addrs(N);
+    for(int i = 0; i < N; i++) { addrs[i] = rng(); }
+    size_t allowed = 0;
+    Bench("IpFilter::Allow rules=100000", N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { allowed += filter->Allow(addrs[i]); }
+    });
+    if(allowed == 0) { fprintf(stderr, "IpFilter: nothing allowed\n"); }
+    filter->Close();
+    unlink(path);
+}
+
+/* ---------------- HeapTimer ---------------- */
+static void BenchHeapTimer() {
+    const int sizes[] = { 10000, 100000, 1000000 };
+    std::mt19937 rng(42);
+    for(int n: sizes) {
+        std::string suffix = " n=" + std::to_string(n);
+        std::unique_ptr<HeapTimer> timer;
+        std::vector<int> ids(n);
+        for(int i = 0; i < n; i++) { ids[i] = i; }
+
+        Bench("HeapTimer::add" + suffix, n, [&] {
+            timer.reset(new HeapTimer());
+            std::shuffle(ids.begin(), ids.end(), rng);
+        }, [&] {
+            for(int i = 0; i < n; i++) { timer->add(ids[i], 60000 + i % 1000, [] {}); }
+        });
+
+        Bench("HeapTimer::adjust" + suffix, n, [&] {
+            timer.reset(new HeapTimer());
+            for(int i = 0; i < n; i++) { timer->add(i, 60000 + i % 1000, [] {}); }
+            std::shuffle(ids.begin(), ids.end(), rng);
+        }, [&] {
+            for(int i = 0; i < n; i++) { timer->adjust(ids[i], 120000); }
+        });
+
+        /* 全部已到期，tick一次清空整个堆 */
+        Bench("HeapTimer::tick expire-all" + suffix, n, [&] {
+            timer.reset(new HeapTimer());
+            std::shuffle(ids.begin(), ids.end(), rng);
+            for(int i = 0; i < n; i++) { timer->add(ids[i], 0, [] {}); }
+        }, [&] {
+            timer->tick();
+        });
+    }
+}
+
+/* ---------------- ThreadPool ---------------- */
+static void BenchThreadPool() {
+    const int producers[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const int TASKS = 200000;
+    for(int p: producers) {
+        std::atomic<int> done(0);
+        Bench("ThreadPool::AddTask producers=" + std::to_string(p), TASKS, [&] {
+            done = 0;
+        }, [&] {
+            ThreadPool pool(6);
+            std::vector<std::thread> threads;
+            for(int t = 0; t < p; t++) {
+                threads.emplace_back([&, t] {
+                    int n = TASKS / p + (t < TASKS % p ? 1 : 0);
+                    for(int i = 0; i < n; i++) {
+                        pool.AddTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+                    }
+                });
+            }
+            for(auto& th: threads) { th.join(); }
+            while(done.load() < TASKS) { std::this_thread::yield(); }
+        });
+    }
+}
+
+/* ---------------- Log ---------------- */
+static void BenchLog() {
+    /* 没有选中任何日志项时不要打开日志，否则会多出写线程和日志文件 */
+    const char* names[] = { "Log::write sync", "Log::write async", "Log::write filtered by level" };
+    bool wanted = g_cfg.filter.empty();
+    for(const char* name: names) {
+        if(strstr(name, g_cfg.filter.c_str())) { wanted = true; }
+    }
+    if(!wanted) { return; }
+
+    const int N = 50000;
+    Log* log = Log::Instance();
+    log->init(1, "./benchlog", ".log", 0);
+    Bench(names[0], N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { LOG_INFO("bench %s %d ==========", "sync", i); }
+    });
+    log->init(1, "./benchlog", ".log", 1024);
+    Bench(names[1], N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { LOG_INFO("bench %s %d ==========", "async", i); }
+    });
+    Bench(names[2], N, nullptr, [&] {
+        for(int i = 0; i < N; i++) { LOG_DEBUG("bench %s %d ==========", "debug", i); }
+    });
+}
+
+int main(int argc, char* argv[]) {
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--filter" && i + 1 < argc) { g_cfg.filter = argv[++i]; }
+        else if(arg == "--reps" && i + 1 < argc) { g_cfg.reps = std::max(1, atoi(argv[++i])); }
+        else if(arg == "--warmup" && i + 1 < argc) { g_cfg.warmup = std::max(0, atoi(argv[++i])); }
+        else if(arg == "--out" && i + 1 < argc) { g_cfg.out = argv[++i]; }
+        else {
+            fprintf(stderr, "Usage: %s [--filter NAME] [--reps N] [--warmup N] [--out FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    BenchBuffer();
+    BenchHttpRequest();
+    BenchHttpRequestHeavy();
+    BenchUrlEncoded();
+    BenchHttpResponse();
+    BenchUserStore();
+    BenchIpFilter();
+    BenchHeapTimer();
+    BenchThreadPool();
+    /* 日志放最后：打开日志后其它组件里的LOG_DEBUG也会参与计时 */
+    BenchLog();
+    WriteJson(g_cfg.out);
+    fprintf(stderr, "results written to %s\n", g_cfg.out.c_str());
+    return 0;
+}
@@ -1,7 +1,15 @@
 
 #include "buffer.h"
 
-Buffer::Buffer(int initBuffSize) : buffer_(initBuffSize), readPos_(0), writePos_(0) {}
+std::atomic<std::size_t> Buffer::totalBytes_(0);
+
+Buffer::Buffer(int initBuffSize) : buffer_(initBuffSize), initSize_(initBuffSize), readPos_(0), writePos_(0) {
+    totalBytes_.fetch_add(buffer_.size(), std::memory_order_relaxed);
+}
+
+Buffer::~Buffer() {
+    totalBytes_.fetch_sub(buffer_.size(), std::memory_order_relaxed);
+}
 
 size_t Buffer::ReadableBytes() const {
     return writePos_ - readPos_;
@@ -34,6 +42,14 @@ void Buffer::RetrieveAll() {
     writePos_ = 0;
 }
 
+void Buffer::Shrink() {
+    if(ReadableBytes() > 0 || buffer_.size() <= initSize_) { return; }
+    totalBytes_.fetch_sub(buffer_.size() - initSize_, std::memory_order_relaxed);
+    std::vector<char>(initSize_).swap(buffer_);
+    readPos_ = 0;
+    writePos_ = 0;
+}
+
 std::string Buffer::RetrieveAllToStr() {
     std::string str(Peek(), ReadableBytes());
     RetrieveAll();
@@ -124,7 +140,9 @@ const char* Buffer::BeginPtr_() const {
 
 void Buffer::MakeSpace_(size_t len) {
     if(WritableBytes() + PrependableBytes() < len) {
+        size_t oldSize = buffer_.size();
         buffer_.resize(writePos_ + len + 1);
+        totalBytes_.fetch_add(buffer_.size() - oldSize, std::memory_order_relaxed);
     } 
     else {
         size_t readable = ReadableBytes();
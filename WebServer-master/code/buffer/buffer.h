@@ -12,7 +12,7 @@
 class Buffer {
 public:
     Buffer(int initBuffSize = 1024);
-    ~Buffer() = default;
+    ~Buffer();
 
     size_t WritableBytes() const;       
     size_t ReadableBytes() const ;
@@ -39,14 +39,23 @@ public:
     ssize_t ReadFd(int fd, int* Errno);
     ssize_t WriteFd(int fd, int* Errno);
 
+    /* 没有未读数据时把扩容过的内存还回去，恢复初始容量 */
+    void Shrink();
+
+    /* 所有Buffer当前占用的内存(按容量算)，用于准入控制 */
+    static size_t TotalBytes() { return totalBytes_.load(std::memory_order_relaxed); }
+
 private:
     char* BeginPtr_();
     const char* BeginPtr_() const;
     void MakeSpace_(size_t len);
 
     std::vector<char> buffer_;
+    size_t initSize_;
     std::atomic<std::size_t> readPos_;
     std::atomic<std::size_t> writePos_;
+
+    static std::atomic<std::size_t> totalBytes_;
 };
 
 #endif //BUFFER_H
\ No newline at end of file
@@ -4,16 +4,28 @@
  * @copyleft Apache 2.0
  */ 
 #include "httpconn.h"
+#include "httpscan.h"
+#include <algorithm>
+#include <ctype.h>
+#include <strings.h>
 using namespace std;
 
 const char* HttpConn::srcDir;
-std::atomic<int> HttpConn::userCount;
+int HttpConn::keepAliveMax;
 bool HttpConn::isET;
 
 HttpConn::HttpConn() { 
     fd_ = -1;
     addr_ = { 0 };
     isClose_ = true;
+    gen_ = 0;
+    phase_ = PHASE_IDLE;
+    phaseStartMs_ = progressBytes_ = lastActiveMs_ = 0;
+    inflight_ = 0;
+    closeRequested_ = false;
+    requests_ = 0;
+    ResetScan_();
+    startNs_ = 0;
 };
 
 HttpConn::~HttpConn() { 
@@ -22,22 +34,38 @@ HttpConn::~HttpConn() {
 
 void HttpConn::init(int fd, const sockaddr_in& addr) {
     assert(fd > 0);
-    userCount++;
     addr_ = addr; //sockaddr_in是一个结构体，包含了ip地址和端口号
     fd_ = fd; 
     writeBuff_.RetrieveAll(); //清空写缓冲区
     readBuff_.RetrieveAll(); //清空读缓冲区
-    isClose_ = false;
-    LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), GetPort(), (int)userCount); //打印日志
+    writeBuff_.Shrink();
+    readBuff_.Shrink();
+    ResetScan_();
+    isClose_.store(false, std::memory_order_release);
+    inflight_.store(0, std::memory_order_relaxed);
+    closeRequested_.store(false, std::memory_order_relaxed);
+    requests_ = 0;
+    SetPhase_(PHASE_IDLE);
+    gen_.fetch_add(1, std::memory_order_release);
+    Metrics::Instance()->Inc(CONN_ACCEPTED);
+    LOG_INFO_RL("Client[%d](%s:%d) in", fd_, GetIP(), GetPort()); //打印日志
+}
+
+void HttpConn::SetKeepAlive(int maxRequests, int idleMs) {
+    /* 通告的超时取整到秒向下取，客户端不会在服务端关闭之后还复用连接 */
+    keepAliveMax = idleMs >= 1000 ? maxRequests : 0;
+    HttpResponse::SetKeepAlive(keepAliveMax, idleMs / 1000);
 }
 
 void HttpConn::Close() {
-    response_.UnmapFile();
-    if(isClose_ == false){
-        isClose_ = true; 
-        userCount--;
+    /* 事件循环和工作线程都可能关闭同一连接，exchange保证只close一次，不会误关已被复用的fd。
+       代数同时加一，关闭前入队的任务凭代数就能认出连接已失效。munmap也只能做一次 */
+    if(isClose_.exchange(true, std::memory_order_acq_rel) == false){
+        response_.UnmapFile();
+        gen_.fetch_add(1, std::memory_order_release);
         close(fd_);
-        LOG_INFO("Client[%d](%s:%d) quit, UserCount:%d", fd_, GetIP(), GetPort(), (int)userCount);
+        Metrics::Instance()->Inc(CONN_CLOSED);
+        LOG_INFO_RL("Client[%d](%s:%d) quit", fd_, GetIP(), GetPort());
     }
 }
 
@@ -58,17 +86,109 @@ int HttpConn::GetPort() const {
 }
 
 ssize_t HttpConn::read(int* saveErrno) {
+    StageTimerRAII timer(STAGE_READ);
     ssize_t len = -1; //ssize_t是有符号整型，用来表示可以读取或写入的字节数，如果出错则返回-1，如果读到文件末尾则返回0
     do {
         len = readBuff_.ReadFd(fd_, saveErrno);//saveErrno是一个指针，指向errno，errno是一个全局变量，用来表明发生了什么错误
         if (len <= 0) {
             break;
         }
+        Metrics::Instance()->Add(BYTES_IN, len);
+        lastActiveMs_ = MonoNs() / 1000000;
+        /* 已超过单个请求的上限就不再读，process()会回431/413 */
+        if(readBuff_.ReadableBytes() > MAX_HEADER_BYTES + MAX_BODY_BYTES) { break; }
     } while (isET); //isET是一个静态变量，表示是否采用ET模式,ET模式下，需要一次性将数据读完，所以需要循环读取
     return len;
 }
 
+void HttpConn::SetPhase_(int phase) {
+    uint64_t now = MonoNs() / 1000000;
+    phaseStartMs_ = now;
+    lastActiveMs_ = now;
+    progressBytes_ = 0;
+    phase_.store(phase, std::memory_order_release);
+}
+
+uint64_t HttpConn::DeadlineMs(int activeMs, int idleMs) const {
+    uint64_t start = phaseStartMs_, bytes = progressBytes_;
+    uint64_t active = lastActiveMs_ + activeMs;
+    switch(Phase()) {
+    case PHASE_IDLE:
+        return lastActiveMs_ + idleMs;
+    case PHASE_HEADER:
+        return std::min<uint64_t>(start + HEADER_TIMEOUT_MS, active);
+    case PHASE_BODY:
+        /* 收到的字节数落后于最低速率时到期 */
+        return start + BODY_GRACE_MS + bytes * 1000 / MIN_BODY_RATE;
+    case PHASE_WRITE:
+        return start + DRAIN_GRACE_MS + bytes * 1000 / MIN_DRAIN_RATE;
+    default:
+        return active;
+    }
+}
+
+void HttpConn::ResetScan_() {
+    scanned_ = 0;
+    headerLen_ = 0;
+    bodyLen_ = 0;
+    headerLines_ = 0;
+    headerDone_ = false;
+    hasBodyLen_ = false;
+}
+
+/* 请求收全返回0，还没收全返回-1，超过上限返回应答的状态码。
+   没收全时不解析，也就不会把半个请求当成整个处理。
+   请求头逐行扫描，已扫过的完整行不再看：scanned_记下一行行首相对Peek()的偏移，
+   Peek()只在请求收全被parse取走后才移动，请求头一个字节一个字节地到也是线性的 */
+int HttpConn::CheckComplete_() {
+    static const char CL[] = "content-length:";
+    const size_t clLen = sizeof(CL) - 1;
+    const char* begin = readBuff_.Peek();
+    const char* end = readBuff_.BeginWriteConst();
+    size_t readable = end - begin;
+    const char* line = begin + scanned_;
+    while(!headerDone_) {
+        const char* crlf = HttpScan::FindCrlf(line, end);
+        if(crlf == end) {
+            scanned_ = line - begin;    // 这一行还没收全，下次从行首接着找
+            return readable > MAX_HEADER_BYTES ? 431 : -1;
+        }
+        if(line == begin) {     // 请求行
+            line = crlf + 2;
+            continue;
+        }
+        if(crlf == line) {      // 空行：请求头结束
+            headerLen_ = line - 2 - begin;
+            headerDone_ = true;
+            break;
+        }
+        if(++headerLines_ > MAX_HEADERS) { return 431; }
+        /* 只看第一个Content-Length，其余请求头留给parse */
+        if(!hasBodyLen_ && static_cast<size_t>(crlf - line) >= clLen && strncasecmp(line, CL, clLen) == 0) {
+            hasBodyLen_ = true;
+            const char* q = line + clLen;
+            while(q < crlf && *q == ' ') { q++; }
+            if(q == crlf || !isdigit(*q)) { return 400; }
+            while(q < crlf && isdigit(*q)) {
+                bodyLen_ = bodyLen_ * 10 + (*q++ - '0');
+                if(bodyLen_ > MAX_BODY_BYTES) { return 413; }
+            }
+        }
+        line = crlf + 2;
+    }
+    if(headerLen_ > MAX_HEADER_BYTES) { return 431; }
+    size_t total = headerLen_ + 4 + bodyLen_;
+    if(readable < total) {
+        if(Phase() != PHASE_BODY) { SetPhase_(PHASE_BODY); }
+        progressBytes_ = readable - headerLen_ - 4;
+        return -1;
+    }
+    return 0;
+}
+
 ssize_t HttpConn::write(int* saveErrno) {
+    StageTimerRAII timer(STAGE_WRITE);
+    if(Phase() != PHASE_WRITE) { SetPhase_(PHASE_WRITE); }
     ssize_t len = -1;
     do {
         len = writev(fd_, iov_, iovCnt_); //writev()函数用于在一次函数调用中写入多个非连续缓冲区，即分散写，返回值为写入的字节数，出错返回-1，
@@ -77,6 +197,8 @@ ssize_t HttpConn::write(int* saveErrno) {
             *saveErrno = errno;
             break;
         }
+        Metrics::Instance()->Add(BYTES_OUT, len);
+        progressBytes_ += len;
         if(iov_[0].iov_len + iov_[1].iov_len  == 0) { break; } /* 传输结束 */ //iov_[0]表示响应头，iov_[1]表示文件 
         else if(static_cast<size_t>(len) > iov_[0].iov_len) {  
             iov_[1].iov_base = (uint8_t*) iov_[1].iov_base + (len - iov_[0].iov_len); 
@@ -92,6 +214,12 @@ ssize_t HttpConn::write(int* saveErrno) {
             writeBuff_.Retrieve(len);
         }
     } while(isET || ToWriteBytes() > 10240);
+    if(ToWriteBytes() == 0) {
+        /* 空闲的长连接不占着为大请求/响应扩容的内存 */
+        writeBuff_.Shrink();
+        readBuff_.Shrink();
+        SetPhase_(PHASE_IDLE);
+    }
     return len;
 }
 
@@ -100,15 +228,85 @@ bool HttpConn::process() {  //处理请求
     if(readBuff_.ReadableBytes() <= 0) {
         return false;
     }
-    else if(request_.parse(readBuff_)) {
+    if(Phase() == PHASE_IDLE) { SetPhase_(PHASE_HEADER); }
+    int check = CheckComplete_();
+    if(check < 0) { return false; }     // 等剩下的数据
+    size_t headerLen = headerLen_, bodyLen = bodyLen_;
+    ResetScan_();   // 收全或出错，下一个请求从头扫描
+    if(check > 0) {
+        Metrics::Instance()->Inc(REQUEST_TOO_LARGE);
+        Shed(check);
+        return true;
+    }
+    SetPhase_(PHASE_PROCESS);
+    requests_++;
+    uint64_t parseStart = MonoNs();
+    bool parsed = request_.parse(readBuff_, headerLen, bodyLen);
+    Metrics::Instance()->Record(STAGE_PARSE, MonoNs() - parseStart);
+    if(parsed) {
         LOG_DEBUG("%s", request_.path().c_str());
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
+        if(request_.IsKeepAlive() && !IsKeepAlive()) {
+            Metrics::Instance()->Inc(KEEPALIVE_LIMIT);  //本次响应带Connection: close，写完即关闭
+        }
+        if(!RateLimiter::Instance()->Acquire(addr_.sin_addr.s_addr)) {
+            /* 超限的请求不读文件也不查库 */
+            Metrics::Instance()->Inc(RATE_LIMITED_REQ);
+            Reject(429);
+            return true;
+        }
+        if(request_.path() == Metrics::PATH) {
+            MakeMetricsResponse_();
+            return true;
+        }
+        if(request_.IsVerifyPending()) {
+            if(!UserStore::Instance()->IsReady()) {
+                /* 用户存储还没就绪(如连接池在预热)，直接回503，不占数据库线程 */
+                Reject(503);
+                return true;
+            }
+            /* 需要查库，响应在Verify()里生成 */
+            return true;
+        }
+        response_.Init(srcDir, request_.path(), IsKeepAlive(), 200);
+        if(request_.EndSession()) {
+            response_.SetCookie(SessionStore::COOKIE_NAME, "", 0);
+        }
     } else {
+        Metrics::Instance()->Inc(PARSE_ERRORS);
         response_.Init(srcDir, request_.path(), false, 400);
     }
-   
-   
-    response_.MakeResponse(writeBuff_);
+    MakeResponse_();
+    return true;
+}
+
+/* 在数据库线程中执行：校验用户后生成响应 */
+void HttpConn::Verify() {
+    request_.Verify();
+    response_.Init(srcDir, request_.path(), IsKeepAlive(), 200);
+    if(!request_.NewSession().empty()) {
+        response_.SetCookie(SessionStore::COOKIE_NAME, request_.NewSession(),
+                            SessionStore::Instance()->TtlSec());
+    }
+    MakeResponse_();
+}
+
+void HttpConn::Register(const function<void()>& done) {
+    uint64_t gen = Generation();
+    request_.Register([this, gen, done](bool ok) {
+        if(IsStale(gen)) { return; }    //等待提交期间连接已超时关闭，或fd已被新连接复用
+        request_.FinishVerify(ok);
+        response_.Init(srcDir, request_.path(), IsKeepAlive(), 200);
+        MakeResponse_();
+        done();
+    });
+}
+
+void HttpConn::MakeResponse_() {
+    {
+        StageTimerRAII timer(STAGE_RESPONSE);
+        response_.MakeResponse(writeBuff_);
+    }
+    Metrics::Instance()->IncStatus(response_.Code());
     /* 响应头 */
     iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
     iov_[0].iov_len = writeBuff_.ReadableBytes();
@@ -121,5 +319,48 @@ bool HttpConn::process() {  //处理请求
         iovCnt_ = 2;
     }
     LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen() , iovCnt_, ToWriteBytes());
-    return true;
+}
+
+/* 指标页直接写入写缓冲区，不经过HttpResponse的静态文件流程 */
+void HttpConn::MakeMetricsResponse_() {
+    std::string body;
+    Metrics::Instance()->Render(body);
+    response_.UnmapFile();
+
+    HttpHead::StatusLine(writeBuff_, 200);
+    HttpHead::Date(writeBuff_);
+    HttpHead::Server(writeBuff_);
+    writeBuff_.Append(IsKeepAlive() ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    writeBuff_.Append("Content-type: text/plain; version=0.0.4\r\n");
+    HttpHead::ContentLength(writeBuff_, body.size());
+    writeBuff_.Append(body);
+    Metrics::Instance()->IncStatus(200);
+    HeadOnlyIov_();
+}
+
+void HttpConn::Shed(int code) {
+    readBuff_.RetrieveAll();
+    ResetScan_();
+    request_.Init();    // 不再是keep-alive，写完即关闭
+    MakeCannedResponse_(code);
+}
+
+void HttpConn::Reject(int code) {
+    request_.CancelVerify();
+    MakeCannedResponse_(code);
+}
+
+void HttpConn::MakeCannedResponse_(int code) {
+    response_.UnmapFile();
+    HttpResponse::CannedResponse(code, IsKeepAlive(), writeBuff_);
+    Metrics::Instance()->IncStatus(code);
+    HeadOnlyIov_();
+}
+
+/* 响应全部在写缓冲区里，没有文件部分 */
+void HttpConn::HeadOnlyIov_() {
+    iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
+    iov_[0].iov_len = writeBuff_.ReadableBytes();
+    iov_[1].iov_len = 0;
+    iovCnt_ = 1;
 }
@@ -15,7 +15,9 @@
 
 #include "../log/log.h"
 #include "../pool/sqlconnRAII.h"
+#include "../pool/ratelimiter.h"
 #include "../buffer/buffer.h"
+#include "../metrics/metrics.h"
 #include "httprequest.h"
 #include "httpresponse.h"
 
@@ -43,24 +45,123 @@ public:
     
     bool process();
 
+    /* 登录/注册请求解析完后等待查库，由数据库线程调用Verify()完成响应 */
+    bool IsVerifyPending() const {
+        return request_.IsVerifyPending();
+    }
+
+    void Verify();
+
+    bool IsRegisterPending() const {
+        return request_.IsRegisterPending();
+    }
+
+    /* 注册走写后合并队列，批次提交后在后台线程生成响应并调用done */
+    void Register(const std::function<void()>& done);
+
+    /* 不再查库，直接回固定错误响应(如数据库队列已满时的503) */
+    void Reject(int code);
+
+    /* 工作线程、数据库线程池、注册批处理线程都会读，由事件循环或工作线程在Close中写 */
+    bool IsClose() const { return isClose_.load(std::memory_order_acquire); }
+
+    /* 同一个HttpConn对象会被复用给后来的同号fd，每次init和Close都加一。
+       排队的任务记下入队时的代数，执行前比对，连接已关闭或已换人就不再处理 */
+    uint64_t Generation() const { return gen_.load(std::memory_order_acquire); }
+    bool IsStale(uint64_t gen) const { return IsClose() || Generation() != gen; }
+
+    /* 过载或请求过大时：不解析已读到的请求，直接回固定错误响应并在写完后关闭 */
+    void Shed(int code);
+
+    /* 连接所处阶段，定时器按阶段检查截止时刻，防慢速客户端：
+       等请求头有总时限，收请求体和发响应都要求最低速率，空闲用idleMs */
+    enum PHASE {
+        PHASE_IDLE = 0,     // 等下一个请求
+        PHASE_HEADER,       // 请求头未收全
+        PHASE_BODY,         // 请求体未收全
+        PHASE_PROCESS,      // 服务端处理中(如查库)
+        PHASE_WRITE,        // 响应已开始发送
+    };
+    int Phase() const { return phase_.load(std::memory_order_acquire); }
+    /* 当前阶段的截止时刻，毫秒，MonoNs()时基。
+       处理中用activeMs，等下一个请求(含新连接的第一个请求)用长连接的idleMs */
+    uint64_t DeadlineMs(int activeMs, int idleMs) const;
+    uint64_t LastActiveMs() const { return lastActiveMs_; }
+
+    /* 事件循环把读写事件交给线程池前BeginTask，处理线程重新注册epoll事件之后EndTask。
+       先注册后减一：新事件若在两者之间到达，计数先加到2再回到1，不会误判为空闲。
+       计数为0时没有任务排队或执行，事件循环可以安全关闭 */
+    void BeginTask() { inflight_.fetch_add(1, std::memory_order_relaxed); }
+    void EndTask() { inflight_.fetch_sub(1, std::memory_order_release); }
+    bool HasTask() const { return inflight_.load(std::memory_order_acquire) > 0; }
+
+    /* 定时器到期时有任务在途：只做标记，由持有连接的处理线程交还时关闭。init时清除 */
+    void RequestClose() { closeRequested_.store(true, std::memory_order_release); }
+    bool IsCloseRequested() const { return closeRequested_.load(std::memory_order_acquire); }
+
+    /* 可以被过载淘汰：连接打开、等下一个请求、没有任务在途 */
+    bool IsEvictable() const { return !IsClose() && Phase() == PHASE_IDLE && !HasTask(); }
+
     int ToWriteBytes() { 
         return iov_[0].iov_len + iov_[1].iov_len; 
     }
 
+    /* 客户端要求保持连接，且本连接处理的请求数还没到上限 */
     bool IsKeepAlive() const {
-        return request_.IsKeepAlive();
+        return request_.IsKeepAlive() && keepAliveMax > 0 && requests_ < keepAliveMax;
     }
 
+    /* 长连接策略：每个连接最多处理maxRequests个请求，空闲idleMs后关闭，同时写进响应头。
+       idleMs不足1秒时不保持连接。在处理第一个请求之前调用 */
+    static void SetKeepAlive(int maxRequests, int idleMs);
+
+    /* 本次请求对应的epoll事件返回时刻，用于统计端到端耗时 */
+    void SetStartTime(uint64_t ns) { startNs_ = ns; }
+    uint64_t StartTime() const { return startNs_; }
+
     static bool isET;    //bool变量表示是否处于测试模式
     static const char* srcDir; //一个指向字符的指针，用于储存源代码目录的路径
-    static std::atomic<int> userCount; //一个原子整数类型的静态变量，用于记录当前活跃的用户数，原子操作，不会被其他线程干扰，并发计数器的功能
+    static int keepAliveMax; //每个连接最多处理的请求数，0表示不保持连接
+
+    static const int HEADER_TIMEOUT_MS = 10000;   // 请求头必须在首字节到达后这么久内收全
+    static const int BODY_GRACE_MS = 5000;        // 请求体/响应在最低速率之外额外宽限的时间
+    static const int MIN_BODY_RATE = 1024;        // 请求体最低接收速率 字节/秒
+    static const int DRAIN_GRACE_MS = 10000;
+    static const int MIN_DRAIN_RATE = 4096;       // 响应最低发送速率 字节/秒
+    static const size_t MAX_HEADER_BYTES = 8192;  // 请求行+请求头，超出回431
+    static const int MAX_HEADERS = 64;
+    static const size_t MAX_BODY_BYTES = 65536;   // 只有登录注册表单，超出回413
     
 private:
-   
+    void MakeResponse_();
+    void MakeMetricsResponse_();
+    void MakeCannedResponse_(int code);
+    void HeadOnlyIov_();
+    int CheckComplete_();
+    void ResetScan_();
+    void SetPhase_(int phase);
+
     int fd_;
     struct  sockaddr_in addr_;
 
-    bool isClose_;
+    std::atomic<bool> isClose_;
+    std::atomic<uint64_t> gen_;
+    std::atomic<int> phase_;
+    std::atomic<uint64_t> phaseStartMs_;    // 本阶段开始时刻
+    std::atomic<uint64_t> progressBytes_;   // 本阶段已收/已发字节数
+    std::atomic<uint64_t> lastActiveMs_;
+    std::atomic<int> inflight_;
+    std::atomic<bool> closeRequested_;
+    int requests_;  // 本连接已收全的请求数
+
+    /* CheckComplete_跨多次read的扫描进度，偏移都相对readBuff_.Peek() */
+    size_t scanned_;        // 下一个未扫描行的行首
+    size_t headerLen_;      // 请求头结束时到最后一行CRLF之前的长度
+    size_t bodyLen_;
+    int headerLines_;
+    bool headerDone_;
+    bool hasBodyLen_;
+    uint64_t startNs_;
     
     int iovCnt_;
     struct iovec iov_[2];
@@ -0,0 +1,141 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-26
+ * @copyleft Apache 2.0
+ */
+#include "httphead.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+namespace {
+
+struct Status {
+    int code;
+    const char* text;
+    const char* line;
+    size_t len;
+};
+
+#define STATUS_LINE(code, text) \
+    { code, text, "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1 }
+
+constexpr Status STATUS[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(429, "Too Many Requests"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(503, "Service Unavailable"),
+};
+constexpr size_t STATUS_NUM = sizeof(STATUS) / sizeof(STATUS[0]);
+
+#undef STATUS_LINE
+
+constexpr char SERVER[] = "Server: TinyWebServer\r\n";
+constexpr char CONTENT_LENGTH[] = "Content-length: ";
+
+const Status* FindStatus(int code) {
+    for(size_t i = 0; i < STATUS_NUM; i++) {
+        if(STATUS[i].code == code) { return &STATUS[i]; }
+    }
+    return nullptr;
+}
+
+/* Date用顺序锁发布：写者只有事件循环线程，读者是各工作线程。
+   按字存成原子变量，读到一半被改写时序号对不上，重读即可 */
+const size_t DATE_WORDS = 5;
+atomic<uint32_t> dateSeq(0);
+atomic<uint64_t> dateWords[DATE_WORDS];
+time_t dateSec = 0;     // 只有写者访问
+
+const char* DAY[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+const char* MON[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+}
+
+bool HttpHead::StatusLine(Buffer& buff, int code) {
+    const Status* s = FindStatus(code);
+    if(!s) { return false; }
+    buff.Append(s->line, s->len);
+    return true;
+}
+
+const char* HttpHead::StatusText(int code) {
+    const Status* s = FindStatus(code);
+    return s ? s->text : nullptr;
+}
+
+int HttpHead::StatusCode(size_t i) {
+    return i < STATUS_NUM ? STATUS[i].code : 0;
+}
+
+void HttpHead::Server(Buffer& buff) {
+    buff.Append(SERVER, sizeof(SERVER) - 1);
+}
+
+size_t HttpHead::FormatInt(char* out, uint64_t v) {
+    char tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    for(size_t i = 0; i < n; i++) { out[i] = tmp[n - 1 - i]; }
+    return n;
+}
+
+void HttpHead::AppendInt(Buffer& buff, uint64_t v) {
+    char num[20];
+    buff.Append(num, FormatInt(num, v));
+}
+
+void HttpHead::ContentLength(Buffer& buff, size_t len) {
+    char line[sizeof(CONTENT_LENGTH) - 1 + 20 + 4];
+    size_t n = sizeof(CONTENT_LENGTH) - 1;
+    memcpy(line, CONTENT_LENGTH, n);
+    n += FormatInt(line + n, len);
+    memcpy(line + n, "\r\n\r\n", 4);
+    buff.Append(line, n + 4);
+}
+
+void HttpHead::Date(Buffer& buff) {
+    uint64_t words[DATE_WORDS];
+    uint32_t before, after;
+    do {
+        before = dateSeq.load(memory_order_acquire);
+        for(size_t i = 0; i < DATE_WORDS; i++) { words[i] = dateWords[i].load(memory_order_relaxed); }
+        atomic_thread_fence(memory_order_acquire);
+        after = dateSeq.load(memory_order_relaxed);
+    } while((before & 1) || before != after);
+    if(before == 0) { return; }
+    buff.Append(reinterpret_cast<const char*>(words), DATE_LEN);
+}
+
+int HttpHead::UpdateDate() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec != dateSec) {
+        dateSec = now.tv_sec;
+        struct tm t;
+        gmtime_r(&now.tv_sec, &t);
+        uint64_t words[DATE_WORDS] = { 0 };
+        char* line = reinterpret_cast<char*>(words);
+        snprintf(line, sizeof(words), "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                 DAY[t.tm_wday], t.tm_mday, MON[t.tm_mon], t.tm_year + 1900,
+                 t.tm_hour, t.tm_min, t.tm_sec);
+        uint32_t seq = dateSeq.load(memory_order_relaxed);
+        dateSeq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for(size_t i = 0; i < DATE_WORDS; i++) { dateWords[i].store(words[i], memory_order_relaxed); }
+        dateSeq.store(seq + 2, memory_order_release);
+    }
+    return 1000 - static_cast<int>(now.tv_nsec / 1000000);
+}
@@ -0,0 +1,40 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-26
+ * @copyleft Apache 2.0
+ */
+#ifndef HTTP_HEAD_H
+#define HTTP_HEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../buffer/buffer.h"
+
+/* 响应头写入：状态行和常用头部都是预先渲染好的字面量，整数在栈上格式化，
+   Date由事件循环每秒渲染一次。全部直接追加到输出缓冲区，不产生临时string */
+class HttpHead {
+public:
+    /* 未知状态码返回false，什么也不写 */
+    static bool StatusLine(Buffer& buff, int code);
+    /* 状态码对应的短语，未知返回nullptr */
+    static const char* StatusText(int code);
+    /* 遍历所有已知状态码，i从0开始，越界返回0 */
+    static int StatusCode(size_t i);
+
+    /* 还没调用过UpdateDate时不写 */
+    static void Date(Buffer& buff);
+    static void Server(Buffer& buff);
+    /* "Content-length: n\r\n\r\n"，写完即结束响应头 */
+    static void ContentLength(Buffer& buff, size_t len);
+    static void AppendInt(Buffer& buff, uint64_t v);
+    /* out至少20字节，返回写入的长度，不补'\0' */
+    static size_t FormatInt(char* out, uint64_t v);
+
+    /* 只由事件循环线程调用：秒数变了才重新渲染Date，返回距下一秒的毫秒数 */
+    static int UpdateDate();
+
+    static const size_t DATE_LEN = 37;     // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+};
+
+#endif //HTTP_HEAD_H
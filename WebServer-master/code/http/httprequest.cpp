@@ -10,7 +10,11 @@ const unordered_map<string, int> HttpRequest::DEFAULT_HTML_TAG {
 
 void HttpRequest::Init() {
     method_ = path_ = version_ = body_ = "";
+    sessionUser_ = sessionToken_ = newSession_ = "";
+    endSession_ = false;
     state_ = REQUEST_LINE;
+    verifyPending_ = false;
+    isLogin_ = false;
     header_.clear();
     post_.clear();
 }
@@ -22,39 +26,72 @@ bool HttpRequest::IsKeepAlive() const {
     return false;
 }
 
-bool HttpRequest::parse(Buffer& buff) {
-    const char CRLF[] = "\r\n";
-    if(buff.ReadableBytes() <= 0) {
-        return false;
+/* 定界符都由HttpScan按块扫描，逐行解析时只在存入字段时拷贝一次。
+   请求头在空行结束，请求体按字节数取，内容里有CRLF也不截断 */
+bool HttpRequest::parse(Buffer& buff, size_t headerLen, size_t bodyLen) {
+    assert(buff.ReadableBytes() >= headerLen + 4 + bodyLen);
+    const char* begin = buff.Peek();
+    const char* headerEnd = begin + headerLen + 4;     // 含结尾的空行
+    const char* line = begin;
+    bool ok = true;
+    while(ok && state_ != BODY) {
+        const char* lineEnd = HttpScan::FindCrlf(line, headerEnd);
+        if(state_ == REQUEST_LINE) {
+            ok = ParseRequestLine_(line, lineEnd);
+            if(ok) { ParsePath_(); }
+        } else {
+            ok = ParseHeader_(line, lineEnd);
+        }
+        line = lineEnd + 2;
     }
-    while(buff.ReadableBytes() && state_ != FINISH) {
-        const char* lineEnd = search(buff.Peek(), buff.BeginWriteConst(), CRLF, CRLF + 2);
-        std::string line(buff.Peek(), lineEnd);
-        switch(state_)
-        {
-        case REQUEST_LINE:
-            if(!ParseRequestLine_(line)) {
-                return false;
-            }
-            ParsePath_();
-            break;    
-        case HEADERS:
-            ParseHeader_(line);
-            if(buff.ReadableBytes() <= 2) {
-                state_ = FINISH;
-            }
-            break;
-        case BODY:
-            ParseBody_(line);
-            break;
-        default:
-            break;
+    if(ok) {
+        AttachSession_();   //登录表单要先知道有没有会话
+        ParseBody_(headerEnd, headerEnd + bodyLen);
+        if(path_ == "/logout") { Logout_(); }
+        LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(), version_.c_str());
+    }
+    /* 出错也把这个请求整个取走 */
+    buff.RetrieveUntil(headerEnd + bodyLen);
+    return ok;
+}
+
+void HttpRequest::AttachSession_() {
+    auto it = header_.find("Cookie");
+    if(it == header_.end() || !sessionUser_.empty()) { return; }
+    if(!GetCookie_(it->second, SessionStore::COOKIE_NAME, &sessionToken_)) { return; }
+    if(SessionStore::Instance()->Validate(sessionToken_, &sessionUser_)) {
+        Metrics::Instance()->Inc(SESSION_HIT);
+    } else {
+        Metrics::Instance()->Inc(SESSION_MISS);
+    }
+}
+
+/* 注销：删掉服务端会话，响应里让浏览器清掉Cookie，回到登录页 */
+void HttpRequest::Logout_() {
+    if(!sessionToken_.empty()) {
+        SessionStore::Instance()->Remove(sessionToken_);
+        endSession_ = true;
+    }
+    sessionUser_.clear();
+    path_ = "/login.html";
+}
+
+/* Cookie: a=1; sid=...; b=2 */
+bool HttpRequest::GetCookie_(const string& cookies, const char* name, string* value) {
+    size_t nameLen = strlen(name);
+    size_t i = 0, n = cookies.size();
+    while(i < n) {
+        while(i < n && (cookies[i] == ' ' || cookies[i] == ';')) { i++; }
+        size_t end = cookies.find(';', i);
+        if(end == string::npos) { end = n; }
+        if(end - i > nameLen && cookies[i + nameLen] == '='
+           && cookies.compare(i, nameLen, name) == 0) {
+            value->assign(cookies, i + nameLen + 1, end - i - nameLen - 1);
+            return true;
         }
-        if(lineEnd == buff.BeginWrite()) { break; }
-        buff.RetrieveUntil(lineEnd + 2);
+        i = end;
     }
-    LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(), version_.c_str());
-    return true;
+    return false;
 }
 
 void HttpRequest::ParsePath_() {
@@ -71,42 +108,49 @@ void HttpRequest::ParsePath_() {
     }
 }
 
-bool HttpRequest::ParseRequestLine_(const string& line) {
-    regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");
-    smatch subMatch;
-    if(regex_match(line, subMatch, patten)) {   
-        method_ = subMatch[1];
-        path_ = subMatch[2];
-        version_ = subMatch[3];
-        state_ = HEADERS;
-        return true;
+/* METHOD SP target SP HTTP/version，method必须是token，target和version中不能有空格 */
+bool HttpRequest::ParseRequestLine_(const char* begin, const char* end) {
+    const char* methodEnd = HttpScan::SkipToken(begin, end);
+    if(methodEnd != begin && methodEnd != end && *methodEnd == ' ') {
+        const char* target = methodEnd + 1;
+        const char* targetEnd = HttpScan::FindChar(target, end, ' ');
+        const char* version = targetEnd + 1;
+        if(targetEnd != end && end - version >= 5 && memcmp(version, "HTTP/", 5) == 0
+           && HttpScan::FindChar(version + 5, end, ' ') == end) {
+            method_.assign(begin, methodEnd);
+            path_.assign(target, targetEnd);
+            version_.assign(version + 5, end);
+            state_ = HEADERS;
+            return true;
+        }
     }
     LOG_ERROR("RequestLine Error");
     return false;
 }
 
-void HttpRequest::ParseHeader_(const string& line) {
-    regex patten("^([^:]*): ?(.*)$");
-    smatch subMatch;
-    if(regex_match(line, subMatch, patten)) {
-        header_[subMatch[1]] = subMatch[2];
-    }
-    else {
+/* name: value，name必须是token且紧跟':'，冒号后最多跳过一个空格；空行结束头部。
+   不合法的头部行整个请求按400处理 */
+bool HttpRequest::ParseHeader_(const char* begin, const char* end) {
+    if(begin == end) {
         state_ = BODY;
+        return true;
+    }
+    const char* colon = HttpScan::SkipToken(begin, end);
+    if(colon == begin || colon == end || *colon != ':') {
+        LOG_ERROR("Header Error");
+        return false;
     }
+    const char* value = colon + 1;
+    if(value != end && *value == ' ') { value++; }
+    header_[string(begin, colon)].assign(value, end);
+    return true;
 }
 
-void HttpRequest::ParseBody_(const string& line) {
-    body_ = line;
+void HttpRequest::ParseBody_(const char* begin, const char* end) {
+    body_.assign(begin, end);
+    LOG_DEBUG("Body:%s, len:%d", body_.c_str(), body_.size());   //解码会就地改写body_，先记
     ParsePost_();
     state_ = FINISH;
-    LOG_DEBUG("Body:%s, len:%d", line.c_str(), line.size());
-}
-
-int HttpRequest::ConverHex(char ch) {
-    if(ch >= 'A' && ch <= 'F') return ch -'A' + 10;
-    if(ch >= 'a' && ch <= 'f') return ch -'a' + 10;
-    return ch;
 }
 
 void HttpRequest::ParsePost_() {
@@ -116,118 +160,110 @@ void HttpRequest::ParsePost_() {
             int tag = DEFAULT_HTML_TAG.find(path_)->second;
             LOG_DEBUG("Tag:%d", tag);
             if(tag == 0 || tag == 1) {
-                bool isLogin = (tag == 1);
-                if(UserVerify(post_["username"], post_["password"], isLogin)) {
-                    path_ = "/welcome.html";
-                } 
-                else {
-                    path_ = "/error.html";
+                /* 查库放到Verify()，解析阶段不阻塞 */
+                isLogin_ = (tag == 1);
+                verifyPending_ = true;
+                if(isLogin_ && HasSession() && GetPost("username") == sessionUser_) {
+                    /* 已登录的用户再次提交登录表单，会话有效就不查库 */
+                    FinishVerify(true);
                 }
             }
         }
     }   
 }
 
+/* 就地解码，post_只存字段在body_里的偏移，GetPost时才拷贝 */
 void HttpRequest::ParseFromUrlencoded_() {
     if(body_.size() == 0) { return; }
+    body_.resize(UrlEncoded::Decode(&body_[0], body_.size(), &post_));
+}
 
-    string key, value;
-    int num = 0;
-    int n = body_.size();
-    int i = 0, j = 0;
-
-    for(; i < n; i++) {
-        char ch = body_[i];
-        switch (ch) {
-        case '=':
-            key = body_.substr(j, i - j);
-            j = i + 1;
-            break;
-        case '+':
-            body_[i] = ' ';
-            break;
-        case '%':
-            num = ConverHex(body_[i + 1]) * 16 + ConverHex(body_[i + 2]);
-            body_[i + 2] = num % 10 + '0';
-            body_[i + 1] = num / 10 + '0';
-            i += 2;
-            break;
-        case '&':
-            value = body_.substr(j, i - j);
-            j = i + 1;
-            post_[key] = value;
-            LOG_DEBUG("%s = %s", key.c_str(), value.c_str());
-            break;
-        default:
-            break;
-        }
-    }
-    assert(j <= i);
-    if(post_.count(key) == 0 && j < i) {
-        value = body_.substr(j, i - j);
-        post_[key] = value;
+void HttpRequest::Verify() {
+    assert(verifyPending_);
+    string name = GetPost("username");
+    bool ok = UserVerify(name, GetPost("password"), isLogin_);
+    if(ok && isLogin_) {
+        /* 登录成功签发会话，之后的请求凭Cookie识别用户 */
+        newSession_ = SessionStore::Instance()->Create(name);
+        sessionUser_ = name;
+        Metrics::Instance()->Inc(SESSION_CREATED);
     }
+    FinishVerify(ok);
 }
 
 bool HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin) {
     if(name == "" || pwd == "") { return false; }
-    LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
-    MYSQL* sql;
-    SqlConnRAII(&sql,  SqlConnPool::Instance());
-    assert(sql);
-    
-    bool flag = false;
-    unsigned int j = 0;
-    char order[256] = { 0 };
-    MYSQL_FIELD *fields = nullptr;
-    MYSQL_RES *res = nullptr;
-    
-    if(!isLogin) { flag = true; }
-    /* 查询用户及密码 */
-    snprintf(order, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
-    LOG_DEBUG("%s", order);
+    StageTimerRAII timer(STAGE_DB);
+    LOG_INFO("Verify name:%s", name.c_str());
 
-    if(mysql_query(sql, order)) { 
-        mysql_free_result(res);
-        return false; 
+    /* 登录先查缓存；注册必须以数据库为准，不走缓存 */
+    UserCache* cache = UserCache::Instance();
+    if(isLogin) {
+        UserCache::RESULT cached = cache->Lookup(name, pwd);
+        if(cached == UserCache::VERIFIED) {
+            Metrics::Instance()->Inc(USER_CACHE_HIT);
+            return true;
+        }
+        if(cached == UserCache::ABSENT) {
+            Metrics::Instance()->Inc(USER_CACHE_NEGATIVE_HIT);
+            LOG_DEBUG("pwd error!");
+            return false;
+        }
     }
-    res = mysql_store_result(sql);
-    j = mysql_num_fields(res);
-    fields = mysql_fetch_fields(res);
+    Metrics::Instance()->Inc(USER_CACHE_MISS);
 
-    while(MYSQL_ROW row = mysql_fetch_row(res)) {
-        LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
-        string password(row[1]);
-        /* 注册行为 且 用户名未被使用*/
-        if(isLogin) {
-            if(pwd == password) { flag = true; }
-            else {
-                flag = false;
-                LOG_DEBUG("pwd error!");
-            }
-        } 
-        else { 
-            flag = false; 
-            LOG_DEBUG("user used!");
+    UserStore* store = UserStore::Instance();
+    if(isLogin) {
+        uint64_t version = cache->Version(name);    // 查库期间该用户注册成功则不做负缓存
+        UserStore::RESULT ret = store->Login(name, pwd);
+        if(ret == UserStore::OK) {
+            cache->PutVerified(name, pwd);
+        } else if(ret == UserStore::NOT_FOUND) {
+            cache->PutAbsent(name, version);
         }
+        if(ret != UserStore::OK) { LOG_DEBUG("pwd error!"); }
+        return ret == UserStore::OK;
     }
-    mysql_free_result(res);
-
     /* 注册行为 且 用户名未被使用*/
-    if(!isLogin && flag == true) {
-        LOG_DEBUG("regirster!");
-        bzero(order, 256);
-        snprintf(order, 256,"INSERT INTO user(username, password) VALUES('%s','%s')", name.c_str(), pwd.c_str());
-        LOG_DEBUG( "%s", order);
-        if(mysql_query(sql, order)) { 
-            LOG_DEBUG( "Insert error!");
-            flag = false; 
-        }
-        flag = true;
+    LOG_DEBUG("regirster!");
+    return RegisterDone_(name, store->Register(name, pwd));
+}
+
+bool HttpRequest::RegisterDone_(const string& name, UserStore::RESULT ret) {
+    if(ret == UserStore::EXISTS) {
+        LOG_DEBUG("user used!");
+        return false;
+    }
+    if(ret != UserStore::OK) {
+        LOG_DEBUG( "Insert error!");
+        return false;
     }
-    SqlConnPool::Instance()->FreeConn(sql);
+    UserCache::Instance()->Invalidate(name);
     LOG_DEBUG( "UserVerify success!!");
-    return flag;
+    return true;
+}
+
+void HttpRequest::Register(const function<void(bool)>& done) {
+    assert(IsRegisterPending());
+    string name = GetPost("username"), pwd = GetPost("password");
+    if(name == "" || pwd == "") {
+        done(false);
+        return;
+    }
+    LOG_INFO("Verify name:%s", name.c_str());
+    Metrics::Instance()->Inc(USER_CACHE_MISS);
+    uint64_t start = MonoNs();
+    /* 回调里不能碰this：连接可能已关闭并被新连接复用 */
+    RegisterBatcher::Instance()->Submit(name, pwd, [name, start, done](UserStore::RESULT ret) {
+        bool ok = RegisterDone_(name, ret);
+        Metrics::Instance()->Record(STAGE_DB, MonoNs() - start);
+        done(ok);
+    });
+}
+
+void HttpRequest::FinishVerify(bool ok) {
+    path_ = ok ? "/welcome.html" : "/error.html";
+    verifyPending_ = false;
 }
 
 std::string HttpRequest::path() const{
@@ -248,16 +284,12 @@ std::string HttpRequest::version() const {
 
 std::string HttpRequest::GetPost(const std::string& key) const {
     assert(key != "");
-    if(post_.count(key) == 1) {
-        return post_.find(key)->second;
-    }
-    return "";
+    const UrlEncoded::Field* f = UrlEncoded::Find(body_.data(), post_, key.data(), key.size());
+    return f ? string(body_.data() + f->value, f->valueLen) : "";
 }
 
 std::string HttpRequest::GetPost(const char* key) const {
     assert(key != nullptr);
-    if(post_.count(key) == 1) {
-        return post_.find(key)->second;
-    }
-    return "";
+    const UrlEncoded::Field* f = UrlEncoded::Find(body_.data(), post_, key, strlen(key));
+    return f ? string(body_.data() + f->value, f->valueLen) : "";
 }
\ No newline at end of file
@@ -9,14 +9,18 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
-#include <regex>
+#include <functional>
 #include <errno.h>     
-#include <mysql/mysql.h>  //mysql
 
 #include "../buffer/buffer.h"
+#include "httpscan.h"
+#include "urlencoded.h"
 #include "../log/log.h"
-#include "../pool/sqlconnpool.h"
-#include "../pool/sqlconnRAII.h"
+#include "../metrics/metrics.h"
+#include "../pool/usercache.h"
+#include "../pool/sessionstore.h"
+#include "../store/userstore.h"
+#include "../store/registerbatcher.h"
 
 class HttpRequest {
 public:
@@ -42,7 +46,10 @@ public:
     ~HttpRequest() = default;
 
     void Init();
-    bool parse(Buffer& buff);
+    /* 解析buff开头一个已收全的请求，分帧由HttpConn::CheckComplete_算好：
+       headerLen为请求头到最后一行CRLF之前的长度，bodyLen取自Content-Length。
+       恰好取走这headerLen + 4 + bodyLen字节，流水线上的下一个请求留在buff里 */
+    bool parse(Buffer& buff, size_t headerLen, size_t bodyLen);
 
     std::string path() const;
     std::string& path();
@@ -53,6 +60,29 @@ public:
 
     bool IsKeepAlive() const;
 
+    /* 登录/注册表单已解析，尚未查库 */
+    bool IsVerifyPending() const { return verifyPending_; }
+
+    /* 查库校验用户并改写path_，会阻塞，只应在数据库线程中调用 */
+    void Verify();
+    void CancelVerify() { verifyPending_ = false; }
+
+    bool IsRegisterPending() const { return verifyPending_ && !isLogin_; }
+
+    /* 注册交给写后合并队列，不阻塞；批次提交后在后台线程以注册结果调用done，
+       由调用方确认连接仍有效后再FinishVerify */
+    void Register(const std::function<void(bool)>& done);
+    /* 按校验结果改写path_ */
+    void FinishVerify(bool ok);
+
+    /* 请求带有效的会话Cookie时，解析完即挂上对应用户，不查库 */
+    bool HasSession() const { return !sessionUser_.empty(); }
+    const std::string& SessionUser() const { return sessionUser_; }
+    /* 本次登录新签发的会话令牌，响应需要Set-Cookie；没有则为空 */
+    const std::string& NewSession() const { return newSession_; }
+    /* /logout已删除会话，响应需要清掉Cookie */
+    bool EndSession() const { return endSession_; }
+
     /* 
     todo 
     void HttpConn::ParseFormData() {}
@@ -60,24 +90,31 @@ public:
     */
 
 private:
-    bool ParseRequestLine_(const std::string& line);
-    void ParseHeader_(const std::string& line);
-    void ParseBody_(const std::string& line);
+    bool ParseRequestLine_(const char* begin, const char* end);
+    bool ParseHeader_(const char* begin, const char* end);
+    void ParseBody_(const char* begin, const char* end);
 
     void ParsePath_();
     void ParsePost_();
     void ParseFromUrlencoded_();
+    void AttachSession_();
+    void Logout_();
+    static bool GetCookie_(const std::string& cookies, const char* name, std::string* value);
 
     static bool UserVerify(const std::string& name, const std::string& pwd, bool isLogin);
+    static bool RegisterDone_(const std::string& name, UserStore::RESULT ret);
 
     PARSE_STATE state_;
+    bool verifyPending_;
+    bool isLogin_;
     std::string method_, path_, version_, body_;
+    std::string sessionUser_, sessionToken_, newSession_;
+    bool endSession_;
     std::unordered_map<std::string, std::string> header_;
-    std::unordered_map<std::string, std::string> post_;
+    std::vector<UrlEncoded::Field> post_;     // 偏移相对解码后的body_
 
     static const std::unordered_set<std::string> DEFAULT_HTML;
     static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG;
-    static int ConverHex(char ch);
 };
 
 
@@ -29,25 +29,22 @@ const unordered_map<string, string> HttpResponse::SUFFIX_TYPE = {
     { ".js",    "text/javascript "},
 };
 
-const unordered_map<int, string> HttpResponse::CODE_STATUS = {
-    { 200, "OK" },
-    { 400, "Bad Request" },
-    { 403, "Forbidden" },
-    { 404, "Not Found" },
-};
-
 const unordered_map<int, string> HttpResponse::CODE_PATH = {
     { 400, "/400.html" },
     { 403, "/403.html" },
     { 404, "/404.html" },
 };
 
+string HttpResponse::keepAliveHeader_ = "Connection: close\r\n";
+
 HttpResponse::HttpResponse() {
     code_ = -1;
     path_ = srcDir_ = "";
     isKeepAlive_ = false;
     mmFile_ = nullptr; 
+    inlineFile_ = nullptr;
     mmFileStat_ = { 0 };
+    entry_ = nullptr;
 };
 
 HttpResponse::~HttpResponse() {
@@ -59,15 +56,19 @@ void HttpResponse::Init(const string& srcDir, string& path, bool isKeepAlive, in
     if(mmFile_) { UnmapFile(); }
     code_ = code;
     isKeepAlive_ = isKeepAlive;
+    cookie_.clear();
     path_ = path;
     srcDir_ = srcDir;
     mmFile_ = nullptr; 
+    inlineFile_ = nullptr;
     mmFileStat_ = { 0 };
+    index_.reset();
+    entry_ = nullptr;
 }
 
 void HttpResponse::MakeResponse(Buffer& buff) {
     /* 判断请求的资源文件 */
-    if(stat((srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode)) {
+    if(!FindFile_()) {
         code_ = 404;
     }
     else if(!(mmFileStat_.st_mode & S_IROTH)) {
@@ -83,44 +84,75 @@ void HttpResponse::MakeResponse(Buffer& buff) {
 }
 
 char* HttpResponse::File() {
-    return mmFile_;
+    return mmFile_ ? mmFile_ : const_cast<char*>(inlineFile_);
 }
 
 size_t HttpResponse::FileLen() const {
     return mmFileStat_.st_size;
 }
 
+/* 填好mmFileStat_，文件不存在或是目录时返回false。
+   先查静态资源索引；索引不可用或没收录时才stat，确认不存在的路径记进索引的负缓存 */
+bool HttpResponse::FindFile_() {
+    mmFileStat_ = { 0 };
+    int found = StaticIndex::Instance()->Find(path_, index_, &entry_);
+    if(found == StaticIndex::FOUND) {
+        mmFileStat_.st_size = entry_->size;
+        mmFileStat_.st_mode = entry_->mode;
+        mmFileStat_.st_mtime = entry_->mtime;
+        return true;
+    }
+    if(found == StaticIndex::MISSING) { return false; }
+    if(stat((srcDir_ + path_).data(), &mmFileStat_) < 0) {
+        StaticIndex::Instance()->AddMissing(path_);
+        return false;
+    }
+    return !S_ISDIR(mmFileStat_.st_mode);
+}
+
 void HttpResponse::ErrorHtml_() {
     if(CODE_PATH.count(code_) == 1) {
         path_ = CODE_PATH.find(code_)->second;
-        stat((srcDir_ + path_).data(), &mmFileStat_);
+        FindFile_();
     }
 }
 
 void HttpResponse::AddStateLine_(Buffer& buff) {
-    string status;
-    if(CODE_STATUS.count(code_) == 1) {
-        status = CODE_STATUS.find(code_)->second;
-    }
-    else {
+    if(!HttpHead::StatusLine(buff, code_)) {
         code_ = 400;
-        status = CODE_STATUS.find(400)->second;
+        HttpHead::StatusLine(buff, code_);
     }
-    buff.Append("HTTP/1.1 " + to_string(code_) + " " + status + "\r\n");
 }
 
 void HttpResponse::AddHeader_(Buffer& buff) {
-    buff.Append("Connection: ");
-    if(isKeepAlive_) {
-        buff.Append("keep-alive\r\n");
-        buff.Append("keep-alive: max=6, timeout=120\r\n");
-    } else{
-        buff.Append("close\r\n");
+    HttpHead::Date(buff);
+    HttpHead::Server(buff);
+    buff.Append(ConnectionHeader_(isKeepAlive_));
+    if(entry_) {
+        buff.Append(entry_->typeHeader);
+    } else {
+        const string& type = FileType(path_);
+        buff.Append("Content-type: ", 14);
+        buff.Append(type.data(), type.size());
+        buff.Append("\r\n", 2);
     }
-    buff.Append("Content-type: " + GetFileType_() + "\r\n");
+    if(!cookie_.empty()) {
+        buff.Append(cookie_);
+    }
+}
+
+void HttpResponse::SetCookie(const string& name, const string& value, int maxAgeSec) {
+    cookie_ = "Set-Cookie: " + name + "=" + value + "; Path=/; Max-Age=" + to_string(maxAgeSec)
+            + "; HttpOnly; SameSite=Lax\r\n";
 }
 
 void HttpResponse::AddContent_(Buffer& buff) {
+    if(entry_ && entry_->inlined) {
+        /* 内容随索引快照一起保留到下次Init，不用打开文件 */
+        inlineFile_ = entry_->content.data();
+        buff.Append(entry_->lengthHeader);
+        return;
+    }
     int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
     if(srcFd < 0) { 
         ErrorContent(buff, "File NotFound!");
@@ -130,14 +162,30 @@ void HttpResponse::AddContent_(Buffer& buff) {
     /* 将文件映射到内存提高文件的访问速度 
         MAP_PRIVATE 建立一个写入时拷贝的私有映射*/
     LOG_DEBUG("file path %s", (srcDir_ + path_).data());
-    int* mmRet = (int*)mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
-    if(*mmRet == -1) {
+    /* 索引可能还没赶上文件的修改，大小以打开的文件为准，免得mmap越过文件末尾 */
+    struct stat st;
+    if(entry_ && fstat(srcFd, &st) == 0 && (st.st_size != entry_->size || st.st_mtime != entry_->mtime)) {
+        mmFileStat_.st_size = st.st_size;
+        entry_ = nullptr;
+    }
+    if(mmFileStat_.st_size == 0) {
+        /* 空文件不能mmap */
+        close(srcFd);
+        HttpHead::ContentLength(buff, 0);
+        return;
+    }
+    void* mmRet = mmap(0, mmFileStat_.st_size, PROT_READ, MAP_PRIVATE, srcFd, 0);
+    close(srcFd);
+    if(mmRet == MAP_FAILED) {
         ErrorContent(buff, "File NotFound!");
         return; 
     }
     mmFile_ = (char*)mmRet;
-    close(srcFd);
-    buff.Append("Content-length: " + to_string(mmFileStat_.st_size) + "\r\n\r\n");
+    if(entry_) {
+        buff.Append(entry_->lengthHeader);
+    } else {
+        HttpHead::ContentLength(buff, mmFileStat_.st_size);
+    }
 }
 
 void HttpResponse::UnmapFile() {
@@ -145,36 +193,84 @@ void HttpResponse::UnmapFile() {
         munmap(mmFile_, mmFileStat_.st_size);
         mmFile_ = nullptr;
     }
+    inlineFile_ = nullptr;
 }
 
-string HttpResponse::GetFileType_() {
+const string& HttpResponse::FileType(const string& path) {
     /* 判断文件类型 */
-    string::size_type idx = path_.find_last_of('.');
+    static const string plain = "text/plain";
+    string::size_type idx = path.find_last_of('.');
     if(idx == string::npos) {
-        return "text/plain";
+        return plain;
     }
-    string suffix = path_.substr(idx);
-    if(SUFFIX_TYPE.count(suffix) == 1) {
-        return SUFFIX_TYPE.find(suffix)->second;
-    }
-    return "text/plain";
+    auto it = SUFFIX_TYPE.find(path.substr(idx));
+    return it != SUFFIX_TYPE.end() ? it->second : plain;
 }
 
-void HttpResponse::ErrorContent(Buffer& buff, string message) 
-{
-    string body;
-    string status;
-    body += "<html><title>Error</title>";
-    body += "<body bgcolor=\"ffffff\">";
-    if(CODE_STATUS.count(code_) == 1) {
-        status = CODE_STATUS.find(code_)->second;
-    } else {
-        status = "Bad Request";
+void HttpResponse::ErrorContent(Buffer& buff, const string& message) {
+    static const char HEAD[] = "<html><title>Error</title><body bgcolor=\"ffffff\">";
+    static const char TAIL[] = "</p><hr><em>TinyWebServer</em></body></html>";
+    const char* status = HttpHead::StatusText(code_);
+    if(!status) { status = "Bad Request"; }
+    size_t statusLen = strlen(status);
+    char num[20];
+    size_t numLen = HttpHead::FormatInt(num, code_);
+    /* 先算出正文长度写Content-length，再把正文逐段拷进去 */
+    HttpHead::ContentLength(buff, sizeof(HEAD) - 1 + numLen + 3 + statusLen + 4
+                                  + message.size() + sizeof(TAIL) - 1);
+    buff.Append(HEAD, sizeof(HEAD) - 1);
+    buff.Append(num, numLen);
+    buff.Append(" : ", 3);
+    buff.Append(status, statusLen);
+    buff.Append("\n<p>", 4);
+    buff.Append(message.data(), message.size());
+    buff.Append(TAIL, sizeof(TAIL) - 1);
+}
+
+void HttpResponse::SetKeepAlive(int maxRequests, int timeoutSec) {
+    if(maxRequests <= 0 || timeoutSec <= 0) {
+        keepAliveHeader_ = "Connection: close\r\n";
+        return;
     }
-    body += to_string(code_) + " : " + status  + "\n";
-    body += "<p>" + message + "</p>";
-    body += "<hr><em>TinyWebServer</em></body></html>";
+    keepAliveHeader_ = "Connection: keep-alive\r\nKeep-Alive: timeout=" + to_string(timeoutSec)
+                       + ", max=" + to_string(maxRequests) + "\r\n";
+}
+
+const string& HttpResponse::ConnectionHeader_(bool isKeepAlive) {
+    static const string close = "Connection: close\r\n";
+    return isKeepAlive ? keepAliveHeader_ : close;
+}
 
-    buff.Append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
-    buff.Append(body);
+void HttpResponse::CannedResponse(int code, bool isKeepAlive, Buffer& buff) {
+    static const unordered_map<int, string> canned[2] = { RenderCanned_(false), RenderCanned_(true) };
+    auto it = canned[isKeepAlive].find(code);
+    assert(it != canned[isKeepAlive].end());
+    HttpHead::StatusLine(buff, code);
+    HttpHead::Date(buff);
+    buff.Append(it->second);
+}
+
+/* 只渲染Date之后的部分，状态行和Date在CannedResponse里写 */
+unordered_map<int, string> HttpResponse::RenderCanned_(bool isKeepAlive) {
+    unordered_map<int, string> canned;
+    int code;
+    for(size_t i = 0; (code = HttpHead::StatusCode(i)) != 0; i++) {
+        if(code == 200) { continue; }
+        string body;
+        body += "<html><title>Error</title>";
+        body += "<body bgcolor=\"ffffff\">";
+        body += to_string(code) + " : " + HttpHead::StatusText(code) + "\n";
+        body += "<hr><em>TinyWebServer</em></body></html>";
+
+        string& resp = canned[code];
+        resp += "Server: TinyWebServer\r\n";
+        resp += ConnectionHeader_(isKeepAlive);
+        if(code == 503 || code == 429) {
+            resp += "Retry-After: 1\r\n";
+        }
+        resp += "Content-type: text/html\r\n";
+        resp += "Content-length: " + to_string(body.size()) + "\r\n\r\n";
+        resp += body;
+    }
+    return canned;
 }
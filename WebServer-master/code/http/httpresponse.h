@@ -14,6 +14,8 @@
 
 #include "../buffer/buffer.h"
 #include "../log/log.h"
+#include "staticindex.h"
+#include "httphead.h"
 
 class HttpResponse {
 public:
@@ -25,8 +27,19 @@ public:
     void UnmapFile();
     char* File();
     size_t FileLen() const;
-    void ErrorContent(Buffer& buff, std::string message);
+    void ErrorContent(Buffer& buff, const std::string& message);
     int Code() const { return code_; }
+    /* 在Init之后、MakeResponse之前调用，Init会清掉 */
+    void SetCookie(const std::string& name, const std::string& value, int maxAgeSec);
+
+    /* 不读文件的固定错误响应(如数据库未就绪时的503)，首次使用时渲染好，之后拷贝并插入当前的Date */
+    static void CannedResponse(int code, bool isKeepAlive, Buffer& buff);
+
+    /* 长连接响应头里通告的参数，固定响应在首次使用时渲染，需在此之前设置 */
+    static void SetKeepAlive(int maxRequests, int timeoutSec);
+
+    /* 按后缀取MIME类型，未知后缀为text/plain */
+    static const std::string& FileType(const std::string& path);
 
 private:
     void AddStateLine_(Buffer &buff);
@@ -34,20 +47,26 @@ private:
     void AddContent_(Buffer &buff);
 
     void ErrorHtml_();
-    std::string GetFileType_();
+    bool FindFile_();
+    static std::unordered_map<int, std::string> RenderCanned_(bool isKeepAlive);
+    static const std::string& ConnectionHeader_(bool isKeepAlive);
 
     int code_;
     bool isKeepAlive_;
+    std::string cookie_;
 
     std::string path_;
     std::string srcDir_;
     
     char* mmFile_; 
+    const char* inlineFile_;                // 索引里缓存的文件内容，不用munmap
     struct stat mmFileStat_;
+    StaticIndex::TablePtr index_;           // 持有查询时的索引快照，entry_才有效
+    const StaticIndex::Entry* entry_;       // 索引里没有(退回stat)时为空
 
     static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;
-    static const std::unordered_map<int, std::string> CODE_STATUS;
     static const std::unordered_map<int, std::string> CODE_PATH;
+    static std::string keepAliveHeader_;
 };
 
 
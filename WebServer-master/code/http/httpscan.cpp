@@ -0,0 +1,241 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-28
+ * @copyleft Apache 2.0
+ */
+#include "httpscan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr bool IsTchar(int c) {
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+        || c == '!' || c == '#' || c == '$' || c == '%' || c == '&' || c == '\''
+        || c == '*' || c == '+' || c == '-' || c == '.' || c == '^' || c == '_'
+        || c == '`' || c == '|' || c == '~';
+}
+
+constexpr bool IsFormDelim(int c) {
+    return c == '%' || c == '+' || c == '&' || c == '=';
+}
+
+/* tchar[c]、form[c]给标量用；lo[c & 15]的第(c >> 4)位表示c是否为tchar，给AVX2查表用。
+   tchar都小于0x80，高半字节只用到0~7，一个字节的位图放得下 */
+struct CharTable {
+    bool tchar[256];
+    bool form[256];
+    uint8_t lo[16];
+    constexpr CharTable(): tchar(), form(), lo() {
+        for(int c = 0; c < 256; c++) {
+            tchar[c] = IsTchar(c);
+            form[c] = IsFormDelim(c);
+            if(tchar[c]) { lo[c & 15] |= static_cast<uint8_t>(1 << (c >> 4)); }
+        }
+    }
+};
+constexpr CharTable CHARS;
+
+const char* SkipTokenScalar(const char* p, const char* end) {
+    while(p < end && CHARS.tchar[static_cast<unsigned char>(*p)]) { p++; }
+    return p;
+}
+
+uint64_t FormDelimMaskScalar(const char* p, const char* end) {
+    size_t n = end - p < 64 ? end - p : 64;
+    uint64_t mask = 0;
+    for(size_t i = 0; i < n; i++) {
+        mask |= static_cast<uint64_t>(CHARS.form[static_cast<unsigned char>(p[i])]) << i;
+    }
+    return mask;
+}
+
+#ifdef HTTP_SCAN_X86
+
+/* pcmpestri最多8个区间，tchar要9个，'~'单独补判 */
+__attribute__((target("sse4.2")))
+const char* SkipTokenSse42(const char* p, const char* end) {
+    const __m128i ranges = _mm_setr_epi8('!', '!', '#', '\'', '*', '+', '-', '.',
+                                         '0', '9', 'A', 'Z', '^', 'z', '|', '|');
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int i = _mm_cmpestri(ranges, 16, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY);
+        if(i == 16) {
+            p += 16;
+        } else if(p[i] == '~') {
+            p += i + 1;
+        } else {
+            return p + i;
+        }
+    }
+    return SkipTokenScalar(p, end);
+}
+
+/* 四个字符各比一次再合并，比pcmpestri的EQUAL_ANY快。
+   不足64字节的最后一块先拷到栈上补0再比，不读越界 */
+__attribute__((target("sse4.2")))
+inline uint64_t FormDelim16(const char* p) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')),
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('='))));
+    return static_cast<uint32_t>(_mm_movemask_epi8(hit));
+}
+
+__attribute__((target("sse4.2")))
+uint64_t FormDelimMaskSse42(const char* p, const char* end) {
+    char tail[64];
+    if(end - p < 64) {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p, end - p);
+        p = tail;
+    }
+    return FormDelim16(p) | FormDelim16(p + 16) << 16 | FormDelim16(p + 32) << 32 | FormDelim16(p + 48) << 48;
+}
+
+/* 低半字节查出允许的高半字节位图，高半字节查出自己的位，相与为0即非tchar。
+   高半字节8~15(非ASCII)查到0，自然不合法。返回非tchar字节的位图 */
+__attribute__((target("avx2")))
+inline uint32_t NonToken32(const char* p) {
+    const __m256i lut = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(CHARS.lo)));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+    __m256i hi = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+}
+
+/* 尾部不足一块时和前面重叠读最后32字节，位图移掉已经看过的部分 */
+__attribute__((target("avx2")))
+const char* SkipTokenAvx2(const char* p, const char* end) {
+    if(end - p < 32) { return SkipTokenSse42(p, end); }
+    for(; end - p >= 32; p += 32) {
+        uint32_t bad = NonToken32(p);
+        if(bad) { return p + __builtin_ctz(bad); }
+    }
+    if(p == end) { return end; }
+    uint32_t bad = NonToken32(end - 32) >> (p - (end - 32));
+    return bad ? p + __builtin_ctz(bad) : end;
+}
+
+__attribute__((target("avx2")))
+inline uint64_t FormDelim32(const char* p) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')),
+                                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'))),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+                                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('='))));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+}
+
+__attribute__((target("avx2")))
+uint64_t FormDelimMaskAvx2(const char* p, const char* end) {
+    char tail[64];
+    if(end - p < 64) {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p, end - p);
+        p = tail;
+    }
+    return FormDelim32(p) | FormDelim32(p + 32) << 32;
+}
+
+#endif // HTTP_SCAN_X86
+
+struct Kernels {
+    int impl;
+    const char* (*skipToken)(const char*, const char*);
+    uint64_t (*formDelimMask)(const char*, const char*);
+};
+
+const Kernels KERNELS[] = {
+    { HttpScan::SCALAR, SkipTokenScalar, FormDelimMaskScalar },
+#ifdef HTTP_SCAN_X86
+    { HttpScan::SSE42, SkipTokenSse42, FormDelimMaskSse42 },
+    { HttpScan::AVX2, SkipTokenAvx2, FormDelimMaskAvx2 },
+#endif
+};
+
+bool Supported(int impl) {
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(impl == HttpScan::AVX2) { return __builtin_cpu_supports("avx2"); }
+    if(impl == HttpScan::SSE42) { return __builtin_cpu_supports("sse4.2"); }
+#endif
+    return impl == HttpScan::SCALAR;
+}
+
+/* 静态初始化前就是标量实现，其他全局对象的构造函数里调用也安全 */
+const Kernels* kernels = &KERNELS[0];
+
+struct Detect {
+    Detect() {
+        for(int impl = HttpScan::AVX2; impl > HttpScan::SCALAR; impl--) {
+            if(HttpScan::UseImpl(impl)) { break; }
+        }
+    }
+} detect;
+
+}
+
+/* 找单个字节交给memchr：glibc按CPU特性选用的向量实现在短行和长行上都比手写的快，
+   这里只补上CRLF的核对 */
+const char* HttpScan::FindCrlf(const char* p, const char* end) {
+    while(p < end) {
+        p = static_cast<const char*>(memchr(p, '\r', end - p));
+        if(!p) { return end; }
+        if(p + 1 < end && p[1] == '\n') { return p; }
+        p++;
+    }
+    return end;
+}
+
+const char* HttpScan::FindChar(const char* p, const char* end, char c) {
+    const char* q = static_cast<const char*>(memchr(p, c, end - p));
+    return q ? q : end;
+}
+
+const char* HttpScan::SkipToken(const char* p, const char* end) {
+    return kernels->skipToken(p, end);
+}
+
+uint64_t HttpScan::FormDelimMask(const char* p, const char* end) {
+    return kernels->formDelimMask(p, end);
+}
+
+bool HttpScan::IsToken(char c) {
+    return CHARS.tchar[static_cast<unsigned char>(c)];
+}
+
+int HttpScan::Impl() {
+    return kernels->impl;
+}
+
+const char* HttpScan::ImplName(int impl) {
+    switch(impl) {
+    case SCALAR: return "scalar";
+    case SSE42: return "sse4.2";
+    case AVX2: return "avx2";
+    default: return "unknown";
+    }
+}
+
+bool HttpScan::UseImpl(int impl) {
+    for(const Kernels& k : KERNELS) {
+        if(k.impl == impl && Supported(impl)) {
+            kernels = &k;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,41 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-28
+ * @copyleft Apache 2.0
+ */
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 请求解析用的定界符扫描：CRLF、单个字符、token字符(RFC 7230 tchar)、表单的"%+&="。
+   定位单个字节用memchr，glibc已按CPU特性选好向量实现；token校验和表单定界符是字符类判断，
+   x86上另有AVX2(32字节一步)和SSE4.2(16字节一步，token用pcmpestri区间比较)两套实现，
+   启动时按CPU特性选一次，其他情况走标量查表。
+   所有函数只读[p, end)，不会越过end取数；找不到时返回end */
+class HttpScan {
+public:
+    enum IMPL {
+        SCALAR = 0,
+        SSE42,
+        AVX2,
+    };
+
+    /* 第一个"\r\n"中'\r'的位置 */
+    static const char* FindCrlf(const char* p, const char* end);
+    static const char* FindChar(const char* p, const char* end, char c);
+    /* 跳过token字符，返回第一个非token字符的位置 */
+    static const char* SkipToken(const char* p, const char* end);
+    static bool IsToken(char c);
+    /* [p, min(p + 64, end))中'%'、'+'、'&'、'='的位图，第i位对应p[i]，要求p < end。
+       表单里定界符密集，按块取位图逐位处理，比逐个查找少很多次调用 */
+    static uint64_t FormDelimMask(const char* p, const char* end);
+
+    static int Impl();
+    static const char* ImplName(int impl);
+    /* 测试和基准用：切换字符类扫描的实现，CPU不支持时返回false且不切换 */
+    static bool UseImpl(int impl);
+};
+
+#endif //HTTP_SCAN_H
@@ -0,0 +1,220 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-24
+ * @copyleft Apache 2.0
+ */
+#include "staticindex.h"
+#include "httpresponse.h"
+#include "../log/log.h"
+#include "../metrics/metrics.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                                 | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+StaticIndex* StaticIndex::Instance() {
+    static StaticIndex inst;
+    return &inst;
+}
+
+StaticIndex::StaticIndex(): inotifyFd_(-1), wakeFd_(-1) {}
+
+StaticIndex::~StaticIndex() {
+    Close();
+}
+
+/* FNV-1a */
+uint64_t StaticIndex::Hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+const StaticIndex::Entry* StaticIndex::Table::Find(const string& path, uint64_t hash) const {
+    if(slots_.empty()) { return nullptr; }
+    for(size_t i = hash & mask_; ; i = (i + 1) & mask_) {
+        uint32_t slot = slots_[i];
+        if(slot == 0) { return nullptr; }
+        const Entry& e = entries_[slot - 1];
+        if(e.hash == hash && e.path == path) { return &e; }
+    }
+}
+
+/* 0表示空槽，哈希值恰好为0的路径存成1，最多多一次stat */
+bool StaticIndex::Table::IsMissing(uint64_t hash) const {
+    hash |= (hash == 0);
+    return missing_[hash & (MISSING_SLOTS - 1)].load(memory_order_relaxed) == hash;
+}
+
+void StaticIndex::Table::AddMissing(uint64_t hash) const {
+    hash |= (hash == 0);
+    missing_[hash & (MISSING_SLOTS - 1)].store(hash, memory_order_relaxed);
+}
+
+int StaticIndex::Find(const string& path, TablePtr& table, const Entry** entry) const {
+    table = atomic_load(&table_);
+    *entry = nullptr;
+    if(!table) { return UNKNOWN; }
+    uint64_t hash = Hash(path.data(), path.size());
+    *entry = table->Find(path, hash);
+    if(*entry) { return FOUND; }
+    if(table->IsComplete() || table->IsMissing(hash)) { return MISSING; }
+    return UNKNOWN;
+}
+
+void StaticIndex::AddMissing(const string& path) const {
+    TablePtr table = atomic_load(&table_);
+    if(table) { table->AddMissing(Hash(path.data(), path.size())); }
+}
+
+size_t StaticIndex::Size() const {
+    TablePtr table = atomic_load(&table_);
+    return table ? table->Size() : 0;
+}
+
+void StaticIndex::Scan_(const string& rel, int depth, Table* table) {
+    string dirPath = srcDir_ + rel;
+    DIR* dir = opendir(dirPath.c_str());
+    if(!dir) { return; }
+    if(inotifyFd_ >= 0 && inotify_add_watch(inotifyFd_, dirPath.c_str(), WATCH_MASK) < 0) {
+        LOG_WARN("inotify watch %s error: %s", dirPath.c_str(), strerror(errno));
+    }
+    struct dirent* ent;
+    while((ent = readdir(dir)) != nullptr) {
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { continue; }
+        string path = rel + "/" + ent->d_name;
+        struct stat st;
+        if(stat((srcDir_ + path).c_str(), &st) < 0) { continue; }
+        if(S_ISDIR(st.st_mode)) {
+            if(depth < MAX_DEPTH) { Scan_(path, depth + 1, table); }
+            else { table->complete_ = false; }
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)) { continue; }
+        if(table->entries_.size() >= MAX_FILES) {
+            table->complete_ = false;
+            continue;
+        }
+        Entry e;
+        e.path = path;
+        e.hash = Hash(path.data(), path.size());
+        e.size = st.st_size;
+        e.mtime = st.st_mtime;
+        e.mode = st.st_mode;
+        e.type = HttpResponse::FileType(path).c_str();
+        e.typeHeader = string("Content-type: ") + e.type + "\r\n";
+        e.lengthHeader = "Content-length: " + to_string(st.st_size) + "\r\n\r\n";
+        e.inlined = st.st_size <= INLINE_MAX
+                    && table->inlineBytes_ + st.st_size <= INLINE_TOTAL
+                    && ReadFile_(srcDir_ + path, st.st_size, &e.content);
+        if(e.inlined) { table->inlineBytes_ += st.st_size; }
+        table->entries_.push_back(move(e));
+    }
+    closedir(dir);
+}
+
+/* 读到的长度和stat不一致(正在被改写)就不缓存，等inotify事件触发下一次重建 */
+bool StaticIndex::ReadFile_(const string& path, off_t size, string* content) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) { return false; }
+    content->resize(size);
+    off_t got = 0;
+    while(got < size) {
+        ssize_t len = read(fd, &(*content)[got], size - got);
+        if(len <= 0) { break; }
+        got += len;
+    }
+    char extra;
+    bool ok = got == size && read(fd, &extra, 1) == 0;
+    close(fd);
+    if(!ok) { content->clear(); }
+    return ok;
+}
+
+StaticIndex::TablePtr StaticIndex::Build_() {
+    shared_ptr<Table> table = make_shared<Table>();
+    /* srcDir_已去掉结尾的'/'，路径从"/xxx"开始拼，和请求路径一致 */
+    Scan_("", 0, table.get());
+    size_t cap = 16;
+    while(cap < table->entries_.size() * 2) { cap <<= 1; }
+    table->slots_.assign(cap, 0);
+    table->mask_ = cap - 1;
+    for(size_t k = 0; k < table->entries_.size(); k++) {
+        size_t i = table->entries_[k].hash & table->mask_;
+        while(table->slots_[i] != 0) { i = (i + 1) & table->mask_; }
+        table->slots_[i] = static_cast<uint32_t>(k + 1);
+    }
+    table->missing_.reset(new atomic<uint64_t>[MISSING_SLOTS]);
+    for(size_t i = 0; i < MISSING_SLOTS; i++) { table->missing_[i].store(0, memory_order_relaxed); }
+    return table;
+}
+
+bool StaticIndex::Init(const string& srcDir) {
+    Close();
+    srcDir_ = srcDir;
+    if(!srcDir_.empty() && srcDir_.back() == '/') { srcDir_.pop_back(); }
+    inotifyFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(inotifyFd_ < 0 || wakeFd_ < 0) {
+        /* 没法知道文件何时变化，索引可能过期，不如不用 */
+        LOG_WARN("inotify unavailable, static files fall back to stat: %s", strerror(errno));
+        Close();
+        return false;
+    }
+    TablePtr table = Build_();
+    atomic_store(&table_, table);
+    Metrics::Instance()->Inc(STATIC_INDEX_BUILDS);
+    LOG_INFO("Static index: %zu files%s", table->Size(), table->IsComplete() ? "" : " (partial)");
+    watchThread_ = thread(&StaticIndex::WatchLoop_, this);
+    return true;
+}
+
+/* 有事件就先读空，再等到DEBOUNCE_MS内没有新事件才重建，批量拷贝文件只重建一次。
+   新建的子目录在重建时加入监视 */
+void StaticIndex::WatchLoop_() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = { { inotifyFd_, POLLIN, 0 }, { wakeFd_, POLLIN, 0 } };
+    while(true) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) { continue; }
+            break;
+        }
+        if(fds[1].revents) { break; }
+        bool changed = false;
+        do {
+            while(read(inotifyFd_, buf, sizeof(buf)) > 0) { changed = true; }
+        } while(poll(fds, 2, DEBOUNCE_MS) > 0 && !fds[1].revents);
+        if(fds[1].revents) { break; }
+        if(!changed) { continue; }
+        TablePtr table = Build_();
+        atomic_store(&table_, table);
+        Metrics::Instance()->Inc(STATIC_INDEX_BUILDS);
+        LOG_INFO("Static index rebuilt: %zu files%s", table->Size(), table->IsComplete() ? "" : " (partial)");
+    }
+}
+
+void StaticIndex::Close() {
+    lock_guard<mutex> locker(mtx_);
+    if(watchThread_.joinable()) {
+        uint64_t one = 1;
+        ssize_t ret = write(wakeFd_, &one, sizeof(one));
+        (void)ret;
+        watchThread_.join();
+    }
+    if(inotifyFd_ >= 0) { close(inotifyFd_); inotifyFd_ = -1; }
+    if(wakeFd_ >= 0) { close(wakeFd_); wakeFd_ = -1; }
+    atomic_store(&table_, TablePtr());
+}
@@ -0,0 +1,105 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-24
+ * @copyleft Apache 2.0
+ */
+#ifndef STATIC_INDEX_H
+#define STATIC_INDEX_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* 静态资源索引：启动时把资源目录下的普通文件全部stat一遍，建成只读的开放寻址哈希表，
+   每项带大小、mtime、权限、MIME类型和渲染好的响应头片段，小文件(含错误页)连内容一起缓存。
+   请求按路径查一次表即可，不存在的路径回404也不用系统调用。
+   后台线程用inotify监视目录，有变化就重建整张表，shared_ptr原子替换；
+   读者拿到的快照在用完之前一直有效 */
+class StaticIndex {
+public:
+    struct Entry {
+        std::string path;           // 以'/'开头，相对资源目录
+        uint64_t hash;
+        off_t size;
+        time_t mtime;
+        mode_t mode;
+        const char* type;           // MIME类型
+        std::string typeHeader;     // "Content-type: ...\r\n"
+        std::string lengthHeader;   // "Content-length: ...\r\n\r\n"
+        bool inlined;               // content即文件内容，不用再打开文件
+        std::string content;
+    };
+
+    class Table {
+    public:
+        const Entry* Find(const std::string& path, uint64_t hash) const;
+        /* 文件数超过上限时只收录了一部分，查不到的路径还要stat确认 */
+        bool IsComplete() const { return complete_; }
+        bool IsMissing(uint64_t hash) const;
+        void AddMissing(uint64_t hash) const;
+        size_t Size() const { return entries_.size(); }
+
+    private:
+        friend class StaticIndex;
+        std::vector<Entry> entries_;
+        std::vector<uint32_t> slots_;   // entries_下标+1，0为空槽
+        size_t mask_ = 0;
+        bool complete_ = true;
+        size_t inlineBytes_ = 0;
+        /* 确认不存在的路径的哈希，直接映射、新的覆盖旧的，大小固定；随表重建清空 */
+        std::unique_ptr<std::atomic<uint64_t>[]> missing_;
+    };
+    typedef std::shared_ptr<const Table> TablePtr;
+
+    enum RESULT {
+        MISSING = 0,    // 确定没有这个文件
+        FOUND,
+        UNKNOWN,        // 没有可信的索引，由调用方stat
+    };
+
+    static StaticIndex* Instance();
+
+    /* 建索引并开始监视目录；inotify不可用时返回false，之后的查询都是UNKNOWN */
+    bool Init(const std::string& srcDir);
+    void Close();
+
+    /* table持有查询时的快照，entry在它释放之前有效 */
+    int Find(const std::string& path, TablePtr& table, const Entry** entry) const;
+    /* 调用方stat确认不存在后记下，同一路径下次直接MISSING */
+    void AddMissing(const std::string& path) const;
+
+    size_t Size() const;
+
+    static uint64_t Hash(const char* s, size_t len);
+
+    static const size_t MAX_FILES = 65536;
+    static const size_t MISSING_SLOTS = 4096;
+    static const off_t INLINE_MAX = 16 * 1024;          // 不超过这么大的文件缓存内容
+    static const size_t INLINE_TOTAL = 16 * 1024 * 1024; // 缓存内容的总量上限
+    static const int MAX_DEPTH = 16;        // 防止符号链接成环
+    static const int DEBOUNCE_MS = 50;      // 一批文件改动完了再重建
+
+private:
+    StaticIndex();
+    ~StaticIndex();
+
+    TablePtr Build_();
+    void Scan_(const std::string& rel, int depth, Table* table);
+    static bool ReadFile_(const std::string& path, off_t size, std::string* content);
+    void WatchLoop_();
+
+    std::string srcDir_;
+    TablePtr table_;        // 只用std::atomic_load/atomic_store访问
+
+    int inotifyFd_;
+    int wakeFd_;            // Close时写入，唤醒监视线程
+    std::mutex mtx_;
+    std::thread watchThread_;
+};
+
+#endif //STATIC_INDEX_H
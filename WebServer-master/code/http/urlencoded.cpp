@@ -0,0 +1,92 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-29
+ * @copyleft Apache 2.0
+ */
+#include "urlencoded.h"
+#include "httpscan.h"
+
+#include <string.h>
+
+namespace {
+
+/* 非十六进制字符为-1 */
+struct HexTable {
+    int8_t v[256];
+    constexpr HexTable(): v() {
+        for(int c = 0; c < 256; c++) {
+            v[c] = (c >= '0' && c <= '9') ? c - '0'
+                 : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        }
+    }
+};
+constexpr HexTable HEX;
+
+}
+
+/* 每64字节取一次定界符位图，逐位处理：两个定界符之间的普通字节整段搬到写指针w
+   (还没解码过任何字节时r == w，不用搬)。%XX会吃掉后面两个字节，落在其中的位跳过。
+   键和值之间不写'='，字段之间不写'&'，边界全由偏移表示 */
+size_t UrlEncoded::Decode(char* data, size_t len, std::vector<Field>* fields) {
+    const char* r = data;
+    const char* end = data + len;
+    char* w = data;
+    char* key = w;
+    char* value = nullptr;      // 还没遇到'='
+    const char* fieldStart = r;
+    for(const char* block = data; ; block += 64) {
+        uint64_t mask = block < end ? HttpScan::FormDelimMask(block, end) : 0;
+        const char* q = nullptr;
+        while(true) {
+            if(mask) {
+                q = block + __builtin_ctzll(mask);
+                mask &= mask - 1;
+                if(q < r) { continue; }
+            } else if(end - block <= 64) {
+                q = end;        // 最后一块处理完，把end当作一个'&'收尾
+            } else {
+                break;
+            }
+            if(w != r) { memmove(w, r, q - r); }
+            w += q - r;
+            r = q;
+            if(r == end || *r == '&') {
+                if(r != fieldStart) {
+                    char* keyEnd = value ? value : w;
+                    fields->push_back({ static_cast<uint32_t>(key - data), static_cast<uint32_t>(keyEnd - key),
+                                        static_cast<uint32_t>(keyEnd - data), static_cast<uint32_t>(w - keyEnd) });
+                }
+                if(r == end) { return w - data; }
+                r++;
+                fieldStart = r;
+                key = w;
+                value = nullptr;
+            } else if(*r == '+') {
+                *w++ = ' ';
+                r++;
+            } else if(*r == '%') {
+                int hi = end - r >= 3 ? HEX.v[static_cast<unsigned char>(r[1])] : -1;
+                int lo = hi >= 0 ? HEX.v[static_cast<unsigned char>(r[2])] : -1;
+                if(lo >= 0) {
+                    *w++ = static_cast<char>(hi << 4 | lo);
+                    r += 3;
+                } else {
+                    *w++ = *r++;
+                }
+            } else {    // '='：第一个是键值分界，之后的属于值
+                if(value) { *w++ = '='; } else { value = w; }
+                r++;
+            }
+        }
+    }
+}
+
+const UrlEncoded::Field* UrlEncoded::Find(const char* data, const std::vector<Field>& fields,
+                                          const char* key, size_t keyLen) {
+    for(size_t i = fields.size(); i > 0; i--) {
+        const Field& f = fields[i - 1];
+        if(f.keyLen == keyLen && memcmp(data + f.key, key, keyLen) == 0) { return &f; }
+    }
+    return nullptr;
+}
@@ -0,0 +1,36 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-29
+ * @copyleft Apache 2.0
+ */
+#ifndef URL_ENCODED_H
+#define URL_ENCODED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* application/x-www-form-urlencoded解码：一遍扫描，就地把'+'和%XX还原，
+   字段只记录在缓冲区里的偏移和长度，不拷贝也不建map。
+   解码结果只会变短，写指针永远不超过读指针；每个字段的键和值解码后首尾相连 */
+class UrlEncoded {
+public:
+    struct Field {
+        uint32_t key;
+        uint32_t keyLen;
+        uint32_t value;
+        uint32_t valueLen;
+    };
+
+    /* 就地解码data[0, len)，字段按出现顺序追加到fields，偏移相对data。
+       '&'分隔字段，空字段跳过；第一个'='分开键和值，没有'='的值为空；
+       不完整或非十六进制的%XX原样保留'%'。返回解码后有效内容的长度，之后的字节是残留 */
+    static size_t Decode(char* data, size_t len, std::vector<Field>* fields);
+
+    /* 同名字段取最后一个，没有返回nullptr */
+    static const Field* Find(const char* data, const std::vector<Field>& fields,
+                             const char* key, size_t keyLen);
+};
+
+#endif //URL_ENCODED_H
@@ -147,10 +147,11 @@ template<class T>
 bool BlockDeque<T>::pop(T &item) {
     std::unique_lock<std::mutex> locker(mtx_);
     while(deq_.empty()){
-        condConsumer_.wait(locker);
+        /* 先判断是否已关闭，否则Close()在消费者未等待时发出的通知会丢失，析构时join永远等不到 */
         if(isClose_){
             return false;
         }
+        condConsumer_.wait(locker);
     }
     item = deq_.front();
     deq_.pop_front();
@@ -162,11 +163,11 @@ template<class T>
 bool BlockDeque<T>::pop(T &item, int timeout) {
     std::unique_lock<std::mutex> locker(mtx_);
     while(deq_.empty()){
-        if(condConsumer_.wait_for(locker, std::chrono::seconds(timeout)) 
-                == std::cv_status::timeout){
+        if(isClose_){
             return false;
         }
-        if(isClose_){
+        if(condConsumer_.wait_for(locker, std::chrono::seconds(timeout)) 
+                == std::cv_status::timeout){
             return false;
         }
     }
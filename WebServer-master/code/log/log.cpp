@@ -1,5 +1,7 @@
 #include "log.h"
 
+#include <algorithm>
+
 using namespace std;
 
 Log::Log() {
@@ -28,14 +30,11 @@ Log::~Log() {
 }
 
 int Log::GetLevel() {
-    lock_guard<mutex> locker(mtx_); //std::lock_guard是一个RAII(Resource Acquisition Is Initialization)类，它可以自动管理一个互斥锁的加锁和解锁操作。
-                                    //将mtx_这个互斥锁封装成一个lock_guard对象
-    return level_;
+    return level_.load(memory_order_relaxed); //每条日志宏都会调用，用原子读代替加锁
 }
 
 void Log::SetLevel(int level) {
-    lock_guard<mutex> locker(mtx_);
-    level_ = level;
+    level_.store(level, memory_order_relaxed);
 }
 
 void Log::init(int level = 1, const char* path, const char* suffix,
@@ -185,6 +184,78 @@ void Log::AsyncWrite_() {
     }
 }
 
+LogLimiter::LogLimiter(int rate, int burst): LogLimiter(rate, burst, 0, nullptr) {}
+
+LogLimiter::LogLimiter(int rate, int burst, int level, const char* format):
+    level_(level), format_(format),
+    intervalUs_(1000000 / (rate > 0 ? rate : 1)),
+    toleranceUs_(intervalUs_ * (burst > 1 ? burst - 1 : 0)),
+    tat_(0), suppressed_(0) {
+    if(format_) {
+        lock_guard<mutex> locker(RegistryMtx_());
+        Registry_().push_back(this);
+    }
+}
+
+LogLimiter::~LogLimiter() {
+    if(format_) {
+        lock_guard<mutex> locker(RegistryMtx_());
+        vector<LogLimiter*>& reg = Registry_();
+        reg.erase(remove(reg.begin(), reg.end(), this), reg.end());
+    }
+}
+
+/* 函数内静态对象先于任何登记者构造完成，析构在它们之后 */
+mutex& LogLimiter::RegistryMtx_() {
+    static mutex mtx;
+    return mtx;
+}
+
+vector<LogLimiter*>& LogLimiter::Registry_() {
+    static vector<LogLimiter*> registry;
+    return registry;
+}
+
+int LogLimiter::ReportAll() {
+    Log* log = Log::Instance();
+    int total = 0;
+    lock_guard<mutex> locker(RegistryMtx_());
+    for(LogLimiter* limiter : Registry_()) {
+        int n = limiter->suppressed_.exchange(0, memory_order_relaxed);
+        if(n == 0) { continue; }
+        total += n;
+        if(log->IsOpen() && log->GetLevel() <= limiter->level_) {
+            log->write(limiter->level_, "suppressed %d similar messages: \"%s\"", n, limiter->format_);
+        }
+    }
+    if(total > 0) { log->flush(); }
+    return total;
+}
+
+int64_t LogLimiter::NowUs_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); //粗粒度时钟走vDSO，不陷入内核
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool LogLimiter::Allow(int* suppressed) {
+    int64_t now = NowUs_();
+    int64_t tat = tat_.load(memory_order_relaxed);
+    while(true) {
+        int64_t base = tat > now ? tat : now;
+        if(base - now > toleranceUs_) {
+            /* 桶空：只计数，不输出 */
+            suppressed_.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        if(tat_.compare_exchange_weak(tat, base + intervalUs_, memory_order_relaxed)) {
+            break;
+        }
+    }
+    *suppressed = suppressed_.exchange(0, memory_order_relaxed);
+    return true;
+}
+
 Log* Log::Instance() {
     static Log inst;
     return &inst;
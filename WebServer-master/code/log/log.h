@@ -4,6 +4,9 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <time.h>             // clock_gettime
 #include <sys/time.h>
 #include <string.h>
 #include <stdarg.h>           // vastart va_end
@@ -50,7 +53,7 @@ private:
     bool isOpen_;
  
     Buffer buff_;
-    int level_;
+    std::atomic<int> level_; //原子变量，宏里判断日志级别时不必抢mtx_
     bool isAsync_;
 
     FILE* fp_;
@@ -59,6 +62,35 @@ private:
     std::mutex mtx_;//互斥锁
 };
 
+/* 按调用点限流的令牌桶(GCRA实现)，只用一个原子变量做CAS，调用点之间不共享任何锁。
+   rate为每秒放行条数，burst为允许的突发条数；被拒绝的条数累加，下次放行时一并取走用于输出汇总。
+   带format构造的实例登记到全局表，由ReportAll定期把没被取走的计数输出，
+   刷屏后就沉默的调用点也能报出丢了多少 */
+class LogLimiter {
+public:
+    LogLimiter(int rate, int burst);
+    LogLimiter(int rate, int burst, int level, const char* format);
+    ~LogLimiter();
+
+    bool Allow(int* suppressed);
+
+    /* 输出并清零所有已登记调用点的抑制计数，返回输出的总条数 */
+    static int ReportAll();
+
+private:
+    static int64_t NowUs_();
+    static std::mutex& RegistryMtx_();
+    static std::vector<LogLimiter*>& Registry_();
+
+    const int level_;
+    const char* format_;        // nullptr表示未登记
+
+    const int64_t intervalUs_;  // 每个令牌对应的时间间隔
+    const int64_t toleranceUs_; // 突发容忍度 = (burst - 1) * intervalUs_
+    std::atomic<int64_t> tat_;  // 理论到达时间，早于now说明桶是满的
+    std::atomic<int> suppressed_;
+};
+
 //##__VA_ARGS__ 是一个 preprocessor token-pasting 运算符，它将可变参数列表展开，并将其插入到 format 参数中。
 //如果可变参数列表为空，则 ## 运算符的作用是删除 format 参数后面的逗号，避免编译错误。
 //do while(0)实际上只执行一次
@@ -77,4 +109,34 @@ private:
 #define LOG_WARN(format, ...) do {LOG_BASE(2, format, ##__VA_ARGS__)} while(0);
 #define LOG_ERROR(format, ...) do {LOG_BASE(3, format, ##__VA_ARGS__)} while(0);
 
+/* 限流版本：宏展开处定义一个静态LogLimiter，每个调用点各自一个令牌桶。
+   超出速率的日志直接丢弃，只计数；下一条被放行时或者定期的ReportAll时输出一行"suppressed N similar messages"汇总 */
+#ifndef LOG_RL_RATE
+#define LOG_RL_RATE 20
+#endif
+#ifndef LOG_RL_BURST
+#define LOG_RL_BURST 50
+#endif
+
+#define LOG_BASE_RL(level, rate, burst, format, ...) \
+    do {\
+        Log* log = Log::Instance();\
+        if (log->IsOpen() && log->GetLevel() <= level) {\
+            static LogLimiter limiter(rate, burst, level, format);\
+            int suppressed = 0;\
+            if (limiter.Allow(&suppressed)) {\
+                if (suppressed > 0) {\
+                    log->write(level, "suppressed %d similar messages: \"%s\"", suppressed, format);\
+                }\
+                log->write(level, format, ##__VA_ARGS__); \
+                log->flush();\
+            }\
+        }\
+    } while(0);
+
+#define LOG_DEBUG_RL(format, ...) do {LOG_BASE_RL(0, LOG_RL_RATE, LOG_RL_BURST, format, ##__VA_ARGS__)} while(0);
+#define LOG_INFO_RL(format, ...) do {LOG_BASE_RL(1, LOG_RL_RATE, LOG_RL_BURST, format, ##__VA_ARGS__)} while(0);
+#define LOG_WARN_RL(format, ...) do {LOG_BASE_RL(2, LOG_RL_RATE, LOG_RL_BURST, format, ##__VA_ARGS__)} while(0);
+#define LOG_ERROR_RL(format, ...) do {LOG_BASE_RL(3, LOG_RL_RATE, LOG_RL_BURST, format, ##__VA_ARGS__)} while(0);
+
 #endif //LOG_H
\ No newline at end of file
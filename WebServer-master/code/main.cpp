@@ -8,7 +8,13 @@ int main() {
     WebServer server(
         1316, 3, 60000, false,             /* 端口 ET模式 timeoutMs 优雅退出  */
         3306, "root", "root", "webserver", /* Mysql配置 */
-        12, 6, true, 1, 1024);             /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        12, 6, true, 1, 1024,              /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        0, "./user.db",                    /* 用户存储 0:MySQL 1:内嵌mmap哈希表 内嵌存储的数据文件 */
+        "",                                /* Mysql只读副本 host:port,host:port 为空时读写都走主库 */
+        10000, 256, 5000,                  /* 准入控制：最大连接数 缓冲区内存上限(MB) 工作线程排队任务数 */
+        0, 0,                              /* 每个IP每秒请求数 突发请求数 0为不限流 */
+        "",                                /* CIDR放行/拒绝规则文件，修改后自动重载，为空时不过滤 */
+        15000, 100);                       /* 长连接空闲超时(ms) 每个连接最多处理的请求数 */
     server.Start();
 } 
   
\ No newline at end of file
@@ -0,0 +1,107 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-03
+ * @copyleft Apache 2.0
+ */
+#include "histogram.h"
+
+using namespace std;
+
+uint64_t Histogram::HighestValue_(int index) {
+    if(index < SUB_COUNT) {
+        return index;
+    }
+    int shift = (index >> SUB_BITS) - 1;
+    uint64_t sub = (index & (SUB_COUNT - 1)) + SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::RecordCorrected(uint64_t value, uint64_t expectedInterval) {
+    Record(value);
+    if(expectedInterval == 0) { return; }
+    for(uint64_t missing = value; missing > expectedInterval; ) {
+        missing -= expectedInterval;
+        Record(missing);
+    }
+}
+
+void Histogram::Merge(const Histogram& other) {
+    for(int i = 0; i < BUCKET_NUM; i++) {
+        uint64_t n = other.counts_[i].load(memory_order_relaxed);
+        if(n) { counts_[i].fetch_add(n, memory_order_relaxed); }
+    }
+    sum_.fetch_add(other.Sum(), memory_order_relaxed);
+    uint64_t value = other.Max();
+    uint64_t max = max_.load(memory_order_relaxed);
+    while(value > max && !max_.compare_exchange_weak(max, value, memory_order_relaxed)) {}
+}
+
+void Histogram::Reset() {
+    for(int i = 0; i < BUCKET_NUM; i++) {
+        counts_[i].store(0, memory_order_relaxed);
+    }
+    sum_.store(0, memory_order_relaxed);
+    max_.store(0, memory_order_relaxed);
+}
+
+void Histogram::Subtract(const Histogram& base) {
+    int top = -1;
+    for(int i = 0; i < BUCKET_NUM; i++) {
+        uint64_t n = counts_[i].load(memory_order_relaxed) - base.counts_[i].load(memory_order_relaxed);
+        counts_[i].store(n, memory_order_relaxed);
+        if(n) { top = i; }
+    }
+    sum_.store(Sum() - base.Sum(), memory_order_relaxed);
+    uint64_t max = top < 0 ? 0 : HighestValue_(top);
+    if(max < Max()) { max_.store(max, memory_order_relaxed); }
+}
+
+uint64_t Histogram::Count() const {
+    uint64_t total = 0;
+    for(int i = 0; i < BUCKET_NUM; i++) {
+        total += counts_[i].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void Histogram::Percentiles(const double* ps, int n, uint64_t* out) const {
+    uint64_t counts[BUCKET_NUM];
+    uint64_t total = 0;
+    for(int i = 0; i < BUCKET_NUM; i++) {
+        counts[i] = counts_[i].load(memory_order_relaxed);
+        total += counts[i];
+    }
+    uint64_t max = Max();
+    int k = 0;
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKET_NUM && k < n; i++) {
+        seen += counts[i];
+        while(k < n && total > 0 && seen > 0 && seen >= ps[k] / 100.0 * total) {
+            uint64_t v = HighestValue_(i);
+            out[k++] = v < max ? v : max;
+        }
+    }
+    for(; k < n; k++) {
+        out[k] = total > 0 ? max : 0;
+    }
+}
+
+uint64_t Histogram::Percentile(double p) const {
+    uint64_t v = 0;
+    Percentiles(&p, 1, &v);
+    return v;
+}
+
+void Histogram::CumulativeCounts(const uint64_t* bounds, int n, uint64_t* out) const {
+    int k = 0;
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKET_NUM && k < n; i++) {
+        while(k < n && HighestValue_(i) > bounds[k]) {
+            out[k++] = seen;
+        }
+        seen += counts_[i].load(memory_order_relaxed);
+    }
+    for(; k < n; k++) {
+        out[k] = seen;
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-03
+ * @copyleft Apache 2.0
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+/* 单调时钟，纳秒。CLOCK_MONOTONIC走vDSO，不陷入内核 */
+inline uint64_t MonoNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* HDR风格的对数-线性直方图：每个2的幂区间再线性分成SUB_COUNT个桶，相对误差约1/SUB_COUNT。
+   记录只有几次relaxed原子操作，无锁；读取时扫描所有桶得到分位数 */
+class Histogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;     // 超过2^40的值(纳秒约18分钟)记在最后一个桶
+    static const int BUCKET_NUM = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+    Histogram() { Reset(); }
+
+    void Record(uint64_t value) {
+        counts_[Index_(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while(value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    /* 只有一个线程写的直方图用：读-改-写不需要加锁前缀的原子指令 */
+    void RecordLocal(uint64_t value) {
+        std::atomic<uint64_t>& c = counts_[Index_(value)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if(value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    /* 以固定间隔补记漏掉的样本，修正协调遗漏(coordinated omission) */
+    void RecordCorrected(uint64_t value, uint64_t expectedInterval);
+
+    void Merge(const Histogram& other);
+    void Reset();
+    /* 减去较早的一份快照，得到两次之间的区间数据。base的每个桶都不能大于本直方图。
+       区间内的最大值取最高非空桶的上界，误差与分位数相同 */
+    void Subtract(const Histogram& base);
+
+    uint64_t Count() const;
+    uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+    /* ps为升序的百分位(0~100)，一次扫描填满out */
+    void Percentiles(const double* ps, int n, uint64_t* out) const;
+    uint64_t Percentile(double p) const;
+
+    /* bounds为升序的上界，out[i]为不超过bounds[i]的样本数(累计)，供Prometheus的le桶。
+       跨越上界的桶整个算到下一个上界，计数偏保守 */
+    void CumulativeCounts(const uint64_t* bounds, int n, uint64_t* out) const;
+
+private:
+    static int Index_(uint64_t value) {
+        if(value < static_cast<uint64_t>(SUB_COUNT)) {
+            return static_cast<int>(value);
+        }
+        if(value >> MAX_BITS) {
+            value = (1ULL << MAX_BITS) - 1;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + static_cast<int>((value >> shift) - SUB_COUNT);
+    }
+    static uint64_t HighestValue_(int index);
+
+    std::atomic<uint64_t> counts_[BUCKET_NUM];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+#endif //HISTOGRAM_H
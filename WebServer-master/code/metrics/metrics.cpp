@@ -0,0 +1,224 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-02
+ * @copyleft Apache 2.0
+ */
+#include "metrics.h"
+#include "../log/log.h"
+
+using namespace std;
+
+const char* Metrics::PATH = "/metrics";
+
+std::atomic<int> Metrics::nextSlot_(0);
+
+/* 与MetricCounter一一对应：指标名 帮助信息 */
+static const char* COUNTER_INFO[COUNTER_NUM][2] = {
+    { "webserver_connections_accepted_total", "Accepted client connections." },
+    { "webserver_connections_closed_total",   "Closed client connections." },
+    { "webserver_bytes_in_total",             "Bytes read from clients." },
+    { "webserver_bytes_out_total",            "Bytes written to clients." },
+    { "webserver_parse_errors_total",         "Requests that failed to parse." },
+    { "webserver_timer_expirations_total",    "Connections closed by the idle timer." },
+    { "webserver_user_cache_hits_total",      "Logins answered from the verified-credential cache." },
+    { "webserver_user_cache_negative_hits_total", "Logins rejected from the unknown-user cache." },
+    { "webserver_user_cache_misses_total",    "User lookups that went to the database." },
+    { "webserver_sqlpool_connections_opened_total", "MySQL connections opened by SqlConnPool." },
+    { "webserver_sqlpool_connections_closed_total", "MySQL connections closed (evicted, shrunk or shut down)." },
+    { "webserver_sqlpool_wait_timeouts_total", "GetConn calls that gave up without a connection." },
+    { "webserver_register_batches_total",     "Registration batches written by the write-behind queue." },
+    { "webserver_register_rows_total",        "Registrations written by the write-behind queue." },
+    { "webserver_sessions_created_total",     "Sessions issued after a successful login." },
+    { "webserver_session_hits_total",         "Requests whose session cookie was valid." },
+    { "webserver_session_misses_total",       "Requests with an unknown or expired session cookie." },
+    { "webserver_static_tasks_rejected_total", "Reads dropped because the worker pool queue was full." },
+    { "webserver_db_tasks_rejected_total",    "Login/register requests answered 503 because the DB queue was full." },
+    { "webserver_static_tasks_shed_total",    "Requests answered 503 by CoDel on the worker pool." },
+    { "webserver_db_tasks_shed_total",        "Login requests answered 503 by CoDel on the DB pool." },
+    { "webserver_stale_tasks_dropped_total",  "Queued tasks skipped because their connection was closed or reused." },
+    { "webserver_connections_rejected_total", "Accepted connections reset immediately because the server was full." },
+    { "webserver_accept_pauses_total",        "Times the listener was paused by admission control." },
+    { "webserver_rate_limited_connections_total", "Connections reset at accept because the client IP was over its rate." },
+    { "webserver_rate_limited_requests_total", "Requests answered 429 because the client IP was over its rate." },
+    { "webserver_rate_limit_evictions_total", "Still-active rate limiter buckets evicted to make room for another IP." },
+    { "webserver_ip_filter_denied_total",     "Connections reset at accept by the CIDR filter." },
+    { "webserver_ip_filter_reloads_total",    "Times the CIDR filter rules were (re)loaded." },
+    { "webserver_requests_too_large_total",   "Requests refused with 431/413 for exceeding header or body limits." },
+    { "webserver_slow_header_closed_total",   "Connections closed for not finishing request headers in time." },
+    { "webserver_slow_body_closed_total",     "Connections closed for sending the request body below the minimum rate." },
+    { "webserver_slow_drain_closed_total",    "Connections closed for reading the response below the minimum rate." },
+    { "webserver_keepalive_limit_total",      "Keep-alive connections closed after serving their maximum number of requests." },
+    { "webserver_idle_evicted_total",         "Idle keep-alive connections closed early to make room under overload." },
+    { "webserver_static_index_builds_total",  "Times the static resource index was built from the resources directory." },
+};
+
+static const int STATUS_CODES[] = { 200, 400, 403, 404, 429, 500, 503 };
+
+static const char* STAGE_NAME[STAGE_NUM] = {
+    "queue", "db_queue", "read", "parse", "db", "db_wait", "response", "write", "total",
+};
+
+/* 直方图的le上界，秒 */
+static const double LATENCY_BOUNDS[] = { 0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+                                         0.01, 0.05, 0.1, 0.5, 1, 5, 10 };
+static const int BOUND_NUM = sizeof(LATENCY_BOUNDS) / sizeof(LATENCY_BOUNDS[0]);
+
+Metrics* Metrics::Instance() {
+    static Metrics inst;
+    return &inst;
+}
+
+int Metrics::AssignSlot_() {
+    int slot = nextSlot_.fetch_add(1, memory_order_relaxed);
+    return slot < MAX_SLOTS - 1 ? slot : MAX_SLOTS - 1;
+}
+
+int Metrics::CodeIndex_(int code) {
+    for(int i = 0; i < CODE_NUM - 1; i++) {
+        if(STATUS_CODES[i] == code) { return i; }
+    }
+    return CODE_NUM - 1;
+}
+
+void Metrics::IncStatus(int code) {
+    int i = SlotIndex_();
+    atomic<uint64_t>& v = slots_[i].codes[CodeIndex_(code)];
+    if(i == MAX_SLOTS - 1) {
+        v.fetch_add(1, memory_order_relaxed);
+    } else {
+        v.store(v.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+}
+
+/* 只汇总分配出去的槽位 */
+uint64_t Metrics::Sum(MetricCounter c) const {
+    uint64_t sum = 0;
+    int used = nextSlot_.load(memory_order_relaxed);
+    if(used > MAX_SLOTS) { used = MAX_SLOTS; }
+    for(int i = 0; i < used; i++) {
+        sum += slots_[i].counters[c].load(memory_order_relaxed);
+    }
+    return sum;
+}
+
+/* 共享的最后一个槽位可能有多个线程同时分配，只留先装上的 */
+Histogram* Metrics::LatencySlot_(int i) {
+    Histogram* h = new Histogram[STAGE_NUM];
+    Histogram* expect = nullptr;
+    if(!latency_[i].compare_exchange_strong(expect, h, memory_order_acq_rel)) {
+        delete[] h;
+        return expect;
+    }
+    return h;
+}
+
+void Metrics::LatencyTotal_(int stage, Histogram* out) {
+    int used = nextSlot_.load(memory_order_relaxed);
+    if(used > MAX_SLOTS) { used = MAX_SLOTS; }
+    out->Reset();
+    for(int i = 0; i < used; i++) {
+        const Histogram* h = latency_[i].load(memory_order_acquire);
+        if(h) { out->Merge(h[stage]); }
+    }
+}
+
+/* 各桶单调递增，后读的累计值每个桶都不小于快照，相减不会下溢 */
+void Metrics::LatencyInterval_(int stage, Histogram* last, Histogram* out) {
+    LatencyTotal_(stage, out);
+    Histogram total;
+    total.Merge(*out);
+    out->Subtract(last[stage]);
+    last[stage].Reset();
+    last[stage].Merge(total);
+}
+
+void Metrics::AddGauge(const string& name, const string& help,
+                       const function<double()>& getter, const string& labels) {
+    lock_guard<mutex> locker(mtx_);
+    gauges_.push_back({name, help, labels, getter});
+}
+
+/* Prometheus文本格式 */
+void Metrics::Render(string& out) {
+    char line[256];
+    for(int c = 0; c < COUNTER_NUM; c++) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                 COUNTER_INFO[c][0], COUNTER_INFO[c][1], COUNTER_INFO[c][0],
+                 COUNTER_INFO[c][0], (unsigned long long)Sum(static_cast<MetricCounter>(c)));
+        out += line;
+    }
+
+    out += "# HELP webserver_requests_total Responses sent, by status code.\n";
+    out += "# TYPE webserver_requests_total counter\n";
+    for(int k = 0; k < CODE_NUM; k++) {
+        uint64_t sum = 0;
+        for(int i = 0; i < MAX_SLOTS; i++) {
+            sum += slots_[i].codes[k].load(memory_order_relaxed);
+        }
+        if(k < CODE_NUM - 1) {
+            snprintf(line, sizeof(line), "webserver_requests_total{code=\"%d\"} %llu\n",
+                     STATUS_CODES[k], (unsigned long long)sum);
+        } else {
+            snprintf(line, sizeof(line), "webserver_requests_total{code=\"other\"} %llu\n",
+                     (unsigned long long)sum);
+        }
+        out += line;
+    }
+
+    /* 累计的直方图，区间分位数由抓取端按两次抓取之差计算，多个抓取端互不影响 */
+    out += "# HELP webserver_stage_latency_seconds Time spent in each request pipeline stage.\n";
+    out += "# TYPE webserver_stage_latency_seconds histogram\n";
+    uint64_t bounds[BOUND_NUM], counts[BOUND_NUM];
+    for(int b = 0; b < BOUND_NUM; b++) { bounds[b] = static_cast<uint64_t>(LATENCY_BOUNDS[b] * 1e9 + 0.5); }
+    Histogram total;
+    for(int s = 0; s < STAGE_NUM; s++) {
+        LatencyTotal_(s, &total);
+        total.CumulativeCounts(bounds, BOUND_NUM, counts);
+        for(int b = 0; b < BOUND_NUM; b++) {
+            snprintf(line, sizeof(line), "webserver_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                     STAGE_NAME[s], LATENCY_BOUNDS[b], (unsigned long long)counts[b]);
+            out += line;
+        }
+        uint64_t count = total.Count();
+        snprintf(line, sizeof(line), "webserver_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                 "webserver_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                 "webserver_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+                 STAGE_NAME[s], (unsigned long long)count,
+                 STAGE_NAME[s], total.Sum() / 1e9,
+                 STAGE_NAME[s], (unsigned long long)count);
+        out += line;
+    }
+
+    lock_guard<mutex> locker(mtx_);
+    for(size_t i = 0; i < gauges_.size(); i++) {
+        const Gauge_& g = gauges_[i];
+        /* 同名不同标签的仪表盘连续注册，只输出一次HELP/TYPE */
+        if(i == 0 || gauges_[i - 1].name != g.name) {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n",
+                     g.name.c_str(), g.help.c_str(), g.name.c_str());
+            out += line;
+        }
+        if(g.labels.empty()) {
+            snprintf(line, sizeof(line), "%s %.17g\n", g.name.c_str(), g.getter());
+        } else {
+            snprintf(line, sizeof(line), "%s{%s} %.17g\n", g.name.c_str(), g.labels.c_str(), g.getter());
+        }
+        out += line;
+    }
+}
+
+void Metrics::DumpLatency() {
+    const double ps[] = { 50, 99, 99.9 };
+    uint64_t v[3];
+    lock_guard<mutex> locker(latencyMtx_);
+    Histogram window;
+    for(int s = 0; s < STAGE_NUM; s++) {
+        LatencyInterval_(s, lastDump_, &window);
+        uint64_t count = window.Count();
+        if(count == 0) { continue; }
+        window.Percentiles(ps, 3, v);
+        LOG_INFO("latency %-8s count:%llu p50:%.3fms p99:%.3fms p99.9:%.3fms max:%.3fms",
+                 STAGE_NAME[s], (unsigned long long)count,
+                 v[0] / 1e6, v[1] / 1e6, v[2] / 1e6, window.Max() / 1e6);
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-02
+ * @copyleft Apache 2.0
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <stdint.h>
+#include "histogram.h"
+
+/* 计数器编号，新增计数器时同步修改metrics.cpp中的COUNTER_INFO */
+enum MetricCounter {
+    CONN_ACCEPTED = 0,
+    CONN_CLOSED,
+    BYTES_IN,
+    BYTES_OUT,
+    PARSE_ERRORS,
+    TIMER_EXPIRED,
+    USER_CACHE_HIT,
+    USER_CACHE_NEGATIVE_HIT,
+    USER_CACHE_MISS,
+    DB_CONN_OPENED,
+    DB_CONN_CLOSED,
+    DB_WAIT_TIMEOUTS,
+    REGISTER_BATCHES,
+    REGISTER_ROWS,
+    SESSION_CREATED,
+    SESSION_HIT,
+    SESSION_MISS,
+    STATIC_TASKS_REJECTED,
+    DB_TASKS_REJECTED,
+    STATIC_TASKS_SHED,
+    DB_TASKS_SHED,
+    STALE_TASKS_DROPPED,
+    CONN_REJECTED,
+    ACCEPT_PAUSES,
+    RATE_LIMITED_CONN,
+    RATE_LIMITED_REQ,
+    RATE_LIMIT_EVICTIONS,
+    IP_FILTER_DENIED,
+    IP_FILTER_RELOADS,
+    REQUEST_TOO_LARGE,
+    SLOW_HEADER_CLOSED,
+    SLOW_BODY_CLOSED,
+    SLOW_DRAIN_CLOSED,
+    KEEPALIVE_LIMIT,
+    IDLE_EVICTED,
+    STATIC_INDEX_BUILDS,
+    COUNTER_NUM,
+};
+
+/* 请求处理的各个阶段，新增阶段时同步修改metrics.cpp中的STAGE_NAME */
+enum LatencyStage {
+    STAGE_QUEUE = 0,    // 事件分发到线程池后等待执行
+    STAGE_DB_QUEUE,     // 查库请求在数据库线程池排队
+    STAGE_READ,
+    STAGE_PARSE,
+    STAGE_DB,
+    STAGE_DB_WAIT,      // 从连接池取连接
+    STAGE_RESPONSE,
+    STAGE_WRITE,
+    STAGE_TOTAL,        // epoll_wait返回到最后一个字节写出
+    STAGE_NUM,
+};
+
+class Metrics {
+public:
+    static Metrics* Instance();
+
+    /* 计数器：每个线程写自己的槽位，只在抓取时汇总 */
+    void Add(MetricCounter c, uint64_t n = 1) {
+        int i = SlotIndex_();
+        std::atomic<uint64_t>& v = slots_[i].counters[c];
+        if(i == MAX_SLOTS - 1) {
+            v.fetch_add(n, std::memory_order_relaxed);
+        } else {
+            /* 槽位只有本线程写，读-改-写不需要加锁前缀的原子指令 */
+            v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    }
+    void Inc(MetricCounter c) { Add(c, 1); }
+
+    void IncStatus(int code);
+
+    uint64_t Sum(MetricCounter c) const;
+
+    /* 仪表盘：抓取时回调取值，如线程池队列长度、数据库空闲连接数。
+       labels形如backend="127.0.0.1:3307"，同名的应连续注册 */
+    void AddGauge(const std::string& name, const std::string& help,
+                  const std::function<double()>& getter, const std::string& labels = "");
+
+    /* 直方图也按线程分槽，只在抓取和写日志时合并 */
+    void Record(LatencyStage stage, uint64_t ns) {
+        int i = SlotIndex_();
+        Histogram* h = latency_[i].load(std::memory_order_acquire);
+        if(!h) { h = LatencySlot_(i); }
+        if(i == MAX_SLOTS - 1) {
+            h[stage].Record(ns);
+        } else {
+            h[stage].RecordLocal(ns);
+        }
+    }
+
+    /* 各阶段上次写日志以来的分位数写入日志 */
+    void DumpLatency();
+
+    void Render(std::string& out);
+
+    static const char* PATH;
+
+private:
+    Metrics() = default;
+
+    static int SlotIndex_() {
+        static thread_local int slot = AssignSlot_();
+        return slot;
+    }
+    static int AssignSlot_();
+    static int CodeIndex_(int code);
+
+    Histogram* LatencySlot_(int i);
+    /* 汇总所有槽位的累计值 */
+    void LatencyTotal_(int stage, Histogram* out);
+    /* 累计值减去上一次的快照得到区间数据，快照更新为本次累计值。需持有latencyMtx_ */
+    void LatencyInterval_(int stage, Histogram* last, Histogram* out);
+
+    static const int MAX_SLOTS = 128;     // 最后一个槽位给超出的线程共享
+    static const int CODE_NUM = 8;        // 按状态码计数，最后一个为其它状态码
+
+    struct alignas(64) Slot_ {
+        std::atomic<uint64_t> counters[COUNTER_NUM];
+        std::atomic<uint64_t> codes[CODE_NUM];
+    };
+
+    struct Gauge_ {
+        std::string name;
+        std::string help;
+        std::string labels;
+        std::function<double()> getter;
+    };
+
+    Slot_ slots_[MAX_SLOTS] = {};
+    /* 每个槽位STAGE_NUM个直方图，线程第一次记录时分配，随进程存在 */
+    std::atomic<Histogram*> latency_[MAX_SLOTS] = {};
+
+    /* 日志上一次的快照，分位数只反映两次之间的样本；/metrics输出累计值，不需要快照 */
+    std::mutex latencyMtx_;
+    Histogram lastDump_[STAGE_NUM];
+
+    std::mutex mtx_;
+    std::vector<Gauge_> gauges_;
+
+    static std::atomic<int> nextSlot_;
+};
+
+/* 作用域计时，析构时记入对应阶段的直方图 */
+class StageTimerRAII {
+public:
+    explicit StageTimerRAII(LatencyStage stage): stage_(stage), start_(MonoNs()) {}
+    ~StageTimerRAII() { Metrics::Instance()->Record(stage_, MonoNs() - start_); }
+
+private:
+    LatencyStage stage_;
+    uint64_t start_;
+};
+
+#endif //METRICS_H
@@ -0,0 +1,117 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-18
+ * @copyleft Apache 2.0
+ */
+#include "ratelimiter.h"
+#include <time.h>
+#include <assert.h>
+#include <random>
+#include "../metrics/metrics.h"
+
+using namespace std;
+
+RateLimiter::RateLimiter(): mask_(0), seed_(0), emissionUs_(0), toleranceUs_(0), startUs_(0) {}
+
+RateLimiter* RateLimiter::Instance() {
+    static RateLimiter inst;
+    return &inst;
+}
+
+/* 启动时、开始服务前调用 */
+void RateLimiter::Init(int rate, int burst, int slotsLog2) {
+    if(rate <= 0) {
+        emissionUs_ = 0;
+        slots_.reset();
+        return;
+    }
+    assert(slotsLog2 >= 4 && slotsLog2 <= 30);
+    size_t size = static_cast<size_t>(1) << slotsLog2;
+    slots_.reset(new atomic<uint64_t>[size]);
+    for(size_t i = 0; i < size; i++) {
+        slots_[i].store(0, memory_order_relaxed);
+    }
+    mask_ = size - 1;
+    /* 随机种子，客户端无法构造落在同一组槽里的地址 */
+    random_device rd;
+    seed_ = (static_cast<uint64_t>(rd()) << 32) | rd();
+    emissionUs_ = max<uint64_t>(1000000 / rate, 1);
+    toleranceUs_ = emissionUs_ * max(burst, 1);
+    startUs_ = 0;
+    startUs_ = NowUs_();
+}
+
+uint64_t RateLimiter::NowUs_() const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* 相对Init时刻，48位微秒够用近9年 */
+    return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000) - startUs_;
+}
+
+uint64_t RateLimiter::Hash_(in_addr_t ip) const {
+    uint64_t h = ip ^ seed_;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool RateLimiter::Acquire(in_addr_t ip) {
+    return !Enabled() || Update_(ip, true);
+}
+
+bool RateLimiter::Check(in_addr_t ip) {
+    return !Enabled() || Update_(ip, false);
+}
+
+bool RateLimiter::Update_(in_addr_t ip, bool consume) {
+    uint64_t h = Hash_(ip);
+    uint64_t tag = h >> 48;
+    if(tag == 0) { tag = 1; }   // 0表示空槽
+    size_t home = h & mask_;
+    uint64_t now = NowUs_();
+
+    /* CAS失败说明别的线程刚改过这几个槽，重新看一遍；多次失败就放行 */
+    for(int retry = 0; retry < 4; retry++) {
+        size_t victim = home;
+        uint64_t victimWord = 0;
+        uint64_t victimTat = UINT64_MAX;
+        bool found = false;
+        for(int i = 0; i < PROBE; i++) {
+            size_t idx = (home + i) & mask_;
+            uint64_t word = slots_[idx].load(memory_order_acquire);
+            if(word == 0) {
+                if(victimTat != 0) {
+                    victim = idx; victimWord = 0; victimTat = 0;
+                }
+                continue;
+            }
+            if((word >> 48) == tag) {
+                victim = idx; victimWord = word; found = true;
+                break;
+            }
+            uint64_t tat = word & TAT_MASK;
+            if(tat < victimTat) {
+                victim = idx; victimWord = word; victimTat = tat;
+            }
+        }
+
+        uint64_t tat = found ? (victimWord & TAT_MASK) : 0;
+        uint64_t newTat = max(tat, now) + emissionUs_;
+        if(newTat > now + toleranceUs_) {
+            return false;   // 超限不更新tat，停下来后按速率恢复
+        }
+        if(!consume) { return true; }
+        if(!found && victimWord != 0) {
+            /* 淘汰的槽若仍未到期，说明表太小或被大量地址冲击 */
+            if((victimWord & TAT_MASK) > now) { Metrics::Instance()->Inc(RATE_LIMIT_EVICTIONS); }
+        }
+        uint64_t newWord = (tag << 48) | (newTat & TAT_MASK);
+        if(slots_[victim].compare_exchange_weak(victimWord, newWord, memory_order_acq_rel)) {
+            return true;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-18
+ * @copyleft Apache 2.0
+ */
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* 按客户端IPv4地址限流的令牌桶，用GCRA实现：每个地址只需记一个"理论到达时间"tat。
+   固定大小的开放寻址表，每槽一个64位字 = 16位地址标签 | 48位tat(微秒)，整字CAS更新，无锁。
+   查找只在起始槽后的PROBE个槽内进行，找不到时占用其中空槽或tat最小(最久没来)的槽，
+   近似LRU；内存固定，不随地址数增长。标签只有16位，极少数地址可能共用一个桶，只会让它们限得更紧 */
+class RateLimiter {
+public:
+    static RateLimiter* Instance();
+
+    /* rate: 每秒请求数，0为不限流；burst: 允许的突发请求数；表大小为2^slotsLog2个槽 */
+    void Init(int rate, int burst, int slotsLog2 = 20);
+
+    bool Enabled() const { return emissionUs_ > 0; }
+
+    /* 消耗一个令牌，超限返回false */
+    bool Acquire(in_addr_t ip);
+    /* 只检查当前是否已超限，不消耗令牌(accept时用) */
+    bool Check(in_addr_t ip);
+
+private:
+    RateLimiter();
+
+    bool Update_(in_addr_t ip, bool consume);
+    uint64_t NowUs_() const;
+    uint64_t Hash_(in_addr_t ip) const;
+
+    static const int PROBE = 8;
+    static const uint64_t TAT_MASK = (1ULL << 48) - 1;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+    size_t mask_;
+    uint64_t seed_;
+    uint64_t emissionUs_;   // 每个请求的间隔 1/rate
+    uint64_t toleranceUs_;  // 可以提前多少：emission * burst
+    uint64_t startUs_;
+};
+
+#endif //RATELIMITER_H
@@ -0,0 +1,183 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-15
+ * @copyleft Apache 2.0
+ */
+#include "sessionstore.h"
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "../log/log.h"
+
+using namespace std;
+
+const char* SessionStore::COOKIE_NAME = "sid";
+
+SessionStore::SessionStore() {
+    Init(100000, 1800);
+}
+
+SessionStore* SessionStore::Instance() {
+    static SessionStore inst;
+    return &inst;
+}
+
+/* 启动时、开始服务前调用 */
+void SessionStore::Init(size_t maxSessions, int ttlSec) {
+    assert(ttlSec > 0);
+    shardCapacity_ = max<size_t>(maxSessions / SHARD_NUM, 1);
+    ttlSec_ = ttlSec;
+    /* 一圈正好是一个TTL，过期精度为一格 */
+    tickMs_ = max<int64_t>(ttlSec * 1000LL / WHEEL_SIZE, 1);
+    int64_t now = NowTick_();
+    for(auto& shard: shards_) {
+        lock_guard<mutex> locker(shard.mtx);
+        shard.sessions.clear();
+        shard.wheel.assign(WHEEL_SIZE, list<Token_>());
+        shard.tick = now;
+    }
+}
+
+int64_t SessionStore::NowTick_() const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000) / tickMs_;
+}
+
+void SessionStore::Random_(void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while(len > 0) {
+        ssize_t n = getrandom(p, len, 0);
+        if(n < 0) {
+            if(errno == EINTR) { continue; }
+            /* 内核不支持getrandom时退回/dev/urandom */
+            int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+            n = fd >= 0 ? read(fd, p, len) : -1;
+            if(fd >= 0) { close(fd); }
+            if(n <= 0) {
+                LOG_ERROR("SessionStore: no randomness available");
+                abort();
+            }
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+string SessionStore::FormatToken_(const Token_& token) {
+    static const char HEX[] = "0123456789abcdef";
+    string str(TOKEN_LEN, '0');
+    for(int i = 0; i < 16; i++) {
+        str[15 - i] = HEX[(token.hi >> (4 * i)) & 0xf];
+        str[31 - i] = HEX[(token.lo >> (4 * i)) & 0xf];
+    }
+    return str;
+}
+
+bool SessionStore::ParseToken_(const string& str, Token_* token) {
+    if(str.size() != TOKEN_LEN) { return false; }
+    uint64_t v[2] = { 0, 0 };
+    for(size_t i = 0; i < TOKEN_LEN; i++) {
+        char c = str[i];
+        int d;
+        if(c >= '0' && c <= '9') { d = c - '0'; }
+        else if(c >= 'a' && c <= 'f') { d = c - 'a' + 10; }
+        else { return false; }
+        v[i / 16] = (v[i / 16] << 4) | d;
+    }
+    token->hi = v[0];
+    token->lo = v[1];
+    return true;
+}
+
+/* 把时间轮推进到now：每经过一格，清空转回来的那一槽(里面的会话已经一个TTL没被访问) */
+void SessionStore::Advance_(Shard_& shard, int64_t now) {
+    int64_t steps = min<int64_t>(now - shard.tick, WHEEL_SIZE);
+    for(int64_t i = 1; i <= steps; i++) {
+        list<Token_>& slot = shard.wheel[(shard.tick + i) % WHEEL_SIZE];
+        for(const Token_& token: slot) {
+            shard.sessions.erase(token);
+        }
+        slot.clear();
+    }
+    if(now > shard.tick) { shard.tick = now; }
+}
+
+void SessionStore::Erase_(Shard_& shard, unordered_map<Token_, Entry_, TokenHash_>::iterator it) {
+    shard.wheel[it->second.slot].erase(it->second.pos);
+    shard.sessions.erase(it);
+}
+
+/* 当前槽的下一槽是最早放入的，从那里开始找 */
+void SessionStore::EvictOldest_(Shard_& shard) {
+    for(int i = 1; i <= WHEEL_SIZE; i++) {
+        list<Token_>& slot = shard.wheel[(shard.tick + i) % WHEEL_SIZE];
+        if(!slot.empty()) {
+            Erase_(shard, shard.sessions.find(slot.front()));
+            return;
+        }
+    }
+}
+
+string SessionStore::Create(const string& user) {
+    Token_ token;
+    Random_(&token, sizeof(token));
+    Shard_& shard = shards_[token.hi % SHARD_NUM];
+    int64_t now = NowTick_();
+    lock_guard<mutex> locker(shard.mtx);
+    Advance_(shard, now);
+    if(shard.sessions.size() >= shardCapacity_) {
+        EvictOldest_(shard);
+    }
+    uint32_t slot = shard.tick % WHEEL_SIZE;
+    list<Token_>& wheelSlot = shard.wheel[slot];
+    wheelSlot.push_back(token);
+    shard.sessions[token] = { user, slot, prev(wheelSlot.end()) };
+    return FormatToken_(token);
+}
+
+bool SessionStore::Validate(const string& str, string* user) {
+    Token_ token;
+    if(!ParseToken_(str, &token)) { return false; }
+    Shard_& shard = shards_[token.hi % SHARD_NUM];
+    int64_t now = NowTick_();
+    lock_guard<mutex> locker(shard.mtx);
+    Advance_(shard, now);
+    auto it = shard.sessions.find(token);
+    if(it == shard.sessions.end()) {
+        return false;
+    }
+    /* 续期：挪到当前槽 */
+    Entry_& entry = it->second;
+    uint32_t slot = shard.tick % WHEEL_SIZE;
+    if(entry.slot != slot) {
+        shard.wheel[slot].splice(shard.wheel[slot].end(), shard.wheel[entry.slot], entry.pos);
+        entry.slot = slot;
+    }
+    *user = entry.user;
+    return true;
+}
+
+void SessionStore::Remove(const string& str) {
+    Token_ token;
+    if(!ParseToken_(str, &token)) { return; }
+    Shard_& shard = shards_[token.hi % SHARD_NUM];
+    lock_guard<mutex> locker(shard.mtx);
+    auto it = shard.sessions.find(token);
+    if(it != shard.sessions.end()) {
+        Erase_(shard, it);
+    }
+}
+
+size_t SessionStore::Size() {
+    size_t n = 0;
+    for(auto& shard: shards_) {
+        lock_guard<mutex> locker(shard.mtx);
+        n += shard.sessions.size();
+    }
+    return n;
+}
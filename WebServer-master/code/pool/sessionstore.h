@@ -0,0 +1,80 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-15
+ * @copyleft Apache 2.0
+ */
+#ifndef SESSIONSTORE_H
+#define SESSIONSTORE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+/* 登录会话：令牌为128位随机数(32位十六进制，经Set-Cookie下发)，按令牌分片，每片一把锁。
+   过期用时间轮：每次访问把会话挪到当前槽，指针转回该槽时整槽删除，续期和过期都是O(1)。
+   每片容量固定，满了淘汰最早过期的，内存有上界 */
+class SessionStore {
+public:
+    static SessionStore* Instance();
+
+    void Init(size_t maxSessions, int ttlSec);
+
+    /* 新建会话，返回令牌 */
+    std::string Create(const std::string& user);
+    /* 令牌有效时写入用户名并续期 */
+    bool Validate(const std::string& token, std::string* user);
+    void Remove(const std::string& token);
+
+    size_t Size();
+    int TtlSec() const { return ttlSec_; }
+
+    static const char* COOKIE_NAME;
+    static const size_t TOKEN_LEN = 32;
+
+private:
+    SessionStore();
+
+    struct Token_ {
+        uint64_t hi;
+        uint64_t lo;
+        bool operator==(const Token_& t) const { return hi == t.hi && lo == t.lo; }
+    };
+    struct TokenHash_ {
+        size_t operator()(const Token_& t) const { return t.lo; }  // 令牌本身随机，直接取低位
+    };
+
+    struct Entry_ {
+        std::string user;
+        uint32_t slot;
+        std::list<Token_>::iterator pos;   // 在时间轮槽链表中的位置
+    };
+
+    struct Shard_ {
+        std::mutex mtx;
+        std::unordered_map<Token_, Entry_, TokenHash_> sessions;
+        std::vector<std::list<Token_>> wheel;
+        int64_t tick = 0;   // 时间轮已推进到的刻度
+    };
+
+    static bool ParseToken_(const std::string& str, Token_* token);
+    static std::string FormatToken_(const Token_& token);
+    static void Random_(void* buf, size_t len);
+
+    int64_t NowTick_() const;
+    void Advance_(Shard_& shard, int64_t now);
+    void EvictOldest_(Shard_& shard);
+    void Erase_(Shard_& shard, std::unordered_map<Token_, Entry_, TokenHash_>::iterator it);
+
+    static const int SHARD_NUM = 16;
+    static const int WHEEL_SIZE = 64;
+
+    Shard_ shards_[SHARD_NUM];
+    size_t shardCapacity_;
+    int ttlSec_;
+    int64_t tickMs_;
+};
+
+#endif //SESSIONSTORE_H
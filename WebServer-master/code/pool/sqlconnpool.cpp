@@ -2,8 +2,14 @@
 using namespace std;
 
 SqlConnPool::SqlConnPool() {
+    port_ = 0;
+    minConn_ = 0;
+    maxConn_ = 0;
+    waitMs_ = 0;
+    connCount_ = 0;
     useCount_ = 0;
-    freeCount_ = 0;
+    isClose_ = false;
+    ready_ = false;
 }
 
 SqlConnPool* SqlConnPool::Instance() {
@@ -14,70 +20,328 @@ SqlConnPool* SqlConnPool::Instance() {
 void SqlConnPool::Init(const char* host, int port,
             const char* user,const char* pwd, const char* dbName,
             int connSize = 10) {
-    assert(connSize > 0);
-    for (int i = 0; i < connSize; i++) {
-        MYSQL *sql = nullptr;
-        sql = mysql_init(sql);
-        if (!sql) {
-            LOG_ERROR("MySql init error!");
-            assert(sql);
-        }
-        sql = mysql_real_connect(sql, host,
-                                 user, pwd,
-                                 dbName, port, nullptr, 0); /*第七个参数unix_socket，Unix套接字路径，如果未指定，
-                                                            则使用TCP/IP协议连接到数据库服务器
-                                                            第八个参数clientflag，标志位，指定客服端的一些选项，
-                                                            如CLIENT_SSL，启动ssl加密连接
-                                                            CLIENT_PLUGIN_AUTH，启动插件认证
-                                                            CLIENT_CONNECT_ATTRS，启动客户端属性支持
-                                                            CLIENT_MULTI_STATEMENTS，启动多语句支持*/
-        if (!sql) {
-            LOG_ERROR("MySql Connect error!");
-        }
-        connQue_.push(sql);
+    Init(host, port, user, pwd, dbName, connSize, connSize);
+}
+
+void SqlConnPool::Init(const char* host, int port,
+            const char* user,const char* pwd, const char* dbName,
+            int minConn, int maxConn, int waitMs) {
+    assert(minConn >= 0 && maxConn > 0 && minConn <= maxConn);
+    host_ = host;
+    port_ = port;
+    user_ = user;
+    pwd_ = pwd;
+    dbName_ = dbName;
+    minConn_ = minConn;
+    maxConn_ = maxConn;
+    waitMs_ = waitMs;
+    healthThread_ = thread(&SqlConnPool::HealthCheck_, this);
+}
+
+/* 并行建立初始连接：总耗时约为一次建连而不是minConn次；minConn为0时也先建一个，用来判定数据库可用 */
+void SqlConnPool::Warmup_() {
+    int n = max(minConn_, 1);
+    {
+        lock_guard<mutex> locker(mtx_);
+        connCount_ += n;
+    }
+    vector<thread> workers;
+    for(int i = 0; i < n; i++) {
+        workers.emplace_back([this] {
+            MYSQL* sql = Connect_();
+            unique_lock<mutex> locker(mtx_);
+            if(!sql) {
+                connCount_--;
+                Backoff_();
+            } else if(isClose_) {
+                connCount_--;
+                locker.unlock();
+                Disconnect_(sql);
+            } else {
+                idle_.push_back({sql, Clock_::now()});
+                cond_.notify_one();
+            }
+        });
     }
-    MAX_CONN_ = connSize;
-    sem_init(&semId_, 0, MAX_CONN_); //初始化一个信号量，用于控制并发数据库连接池里连接数量，semid信号量结构体，0表示独占信号量，1表示可以被多个进程共享，MAX_CONN_初始化信号量
+    for(auto& t: workers) {
+        t.join();
+    }
+    LOG_INFO("SqlConnPool %s:%d warm-up: %d/%d connections", host_.c_str(), port_, GetConnCount(), n);
 }
 
-MYSQL* SqlConnPool::GetConn() {
-    MYSQL *sql = nullptr;
-    if(connQue_.empty()){
-        LOG_WARN("SqlConnPool busy!");
+/* 建连失败后退避，需持有mtx_ */
+void SqlConnPool::Backoff_() {
+    int retryMs = CONNECT_RETRY_MS;
+    nextConnect_ = Clock_::now() + chrono::milliseconds(retryMs);
+}
+
+MYSQL* SqlConnPool::Connect_(unsigned int timeoutSec) {
+    MYSQL *sql = mysql_init(nullptr);
+    if (!sql) {
+        LOG_ERROR("MySql init error!");
         return nullptr;
-    } 
-    sem_wait(&semId_);   //信号量-1
+    }
+    bool reconnect = true;
+    mysql_options(sql, MYSQL_OPT_RECONNECT, &reconnect); //断线后mysql_ping自动重连，预编译语句随后按thread id重建
+    mysql_options(sql, MYSQL_OPT_CONNECT_TIMEOUT, &timeoutSec);
+    if (!mysql_real_connect(sql, host_.c_str(),
+                            user_.c_str(), pwd_.c_str(),
+                            dbName_.c_str(), port_, nullptr, 0)) { /*第七个参数unix_socket，Unix套接字路径，如果未指定，
+                                                                    则使用TCP/IP协议连接到数据库服务器
+                                                                    第八个参数clientflag，标志位，指定客服端的一些选项，
+                                                                    如CLIENT_SSL，启动ssl加密连接
+                                                                    CLIENT_PLUGIN_AUTH，启动插件认证
+                                                                    CLIENT_CONNECT_ATTRS，启动客户端属性支持
+                                                                    CLIENT_MULTI_STATEMENTS，启动多语句支持*/
+        LOG_ERROR("MySql Connect error: %s", mysql_error(sql));
+        mysql_close(sql);
+        return nullptr;
+    }
     {
-        lock_guard<mutex> locker(mtx_);   //lock_guard智能指针，管理互斥锁的生命周期，mutex互斥量，用于同步多线程访问共享资源的数据结构
-        sql = connQue_.front();
-        connQue_.pop();
+        lock_guard<mutex> locker(mtx_);
+        stmtCache_[sql].threadId = mysql_thread_id(sql);
     }
+    Metrics::Instance()->Inc(DB_CONN_OPENED);
+    ready_.store(true, memory_order_release);
     return sql;
 }
 
+void SqlConnPool::Disconnect_(MYSQL* sql) {
+    unordered_map<string, MYSQL_STMT*> stmts;
+    {
+        lock_guard<mutex> locker(mtx_);
+        auto it = stmtCache_.find(sql);
+        if(it != stmtCache_.end()) {
+            stmts.swap(it->second.stmts);
+            stmtCache_.erase(it);
+        }
+    }
+    for(auto& item: stmts) {
+        mysql_stmt_close(item.second);
+    }
+    mysql_close(sql);
+    Metrics::Instance()->Inc(DB_CONN_CLOSED);
+}
+
+MYSQL* SqlConnPool::GetConn() {
+    return GetConn(waitMs_);
+}
+
+MYSQL* SqlConnPool::GetConn(int timeoutMs) {
+    uint64_t start = MonoNs();
+    Clock_::time_point deadline = Clock_::now() + chrono::milliseconds(timeoutMs);
+    unique_lock<mutex> locker(mtx_);
+    while(!isClose_) {
+        if(!idle_.empty()) {
+            MYSQL* sql = idle_.back().sql;
+            idle_.pop_back();
+            useCount_++;
+            locker.unlock();
+            Metrics::Instance()->Record(STAGE_DB_WAIT, MonoNs() - start);
+            return sql;
+        }
+        /* 当场建连不能超过调用方剩下的等待时间，按整秒向上取 */
+        long long leftMs = chrono::duration_cast<chrono::milliseconds>(deadline - Clock_::now()).count();
+        if(connCount_ < maxConn_ && leftMs > 0 && Clock_::now() >= nextConnect_) {
+            unsigned int timeoutSec = (leftMs + 999) / 1000;
+            if(timeoutSec > CONNECT_TIMEOUT_SEC) { timeoutSec = CONNECT_TIMEOUT_SEC; }
+            connCount_++;   //先占名额，锁外建连
+            locker.unlock();
+            MYSQL* sql = Connect_(timeoutSec);
+            locker.lock();
+            if(sql) {
+                useCount_++;
+                locker.unlock();
+                Metrics::Instance()->Record(STAGE_DB_WAIT, MonoNs() - start);
+                return sql;
+            }
+            connCount_--;
+            Backoff_();
+            continue;
+        }
+        if(connCount_ == 0) { break; }  //没有连接会被归还，不必空等
+        if(cond_.wait_until(locker, deadline) == cv_status::timeout && idle_.empty()) {
+            break;
+        }
+    }
+    locker.unlock();
+    Metrics::Instance()->Inc(DB_WAIT_TIMEOUTS);
+    LOG_WARN_RL("SqlConnPool busy!");
+    return nullptr;
+}
+
 void SqlConnPool::FreeConn(MYSQL* sql) {
     assert(sql);
+    {
+        lock_guard<mutex> locker(mtx_);
+        useCount_--;
+        if(!isClose_) {
+            idle_.push_back({sql, Clock_::now()});
+            cond_.notify_one();
+            return;
+        }
+        connCount_--;
+    }
+    Disconnect_(sql);
+}
+
+/* 定期ping空闲超过一个周期的连接：失败的淘汰，多于minConn且长期空闲的关闭，不足minConn的补齐 */
+void SqlConnPool::HealthCheck_() {
+    Warmup_();
+    unique_lock<mutex> locker(mtx_);
+    while(!isClose_) {
+        /* 一个连接都没建成时按退避间隔重试，尽快结束预热 */
+        int checkMs = CHECK_INTERVAL_MS, idleMs = IDLE_TIMEOUT_MS;
+        int interval = checkMs;
+        if(!IsReady()) { interval = CONNECT_RETRY_MS; }
+        checkCond_.wait_for(locker, chrono::milliseconds(interval));
+        if(isClose_) { break; }
+        Clock_::time_point now = Clock_::now();
+        vector<IdleConn_> checking;
+        vector<MYSQL*> expired;
+        while(!idle_.empty() && idle_.front().lastUsed + chrono::milliseconds(checkMs) <= now) {
+            if(connCount_ - static_cast<int>(expired.size()) > minConn_ &&
+               idle_.front().lastUsed + chrono::milliseconds(idleMs) <= now) {
+                expired.push_back(idle_.front().sql);
+            } else {
+                checking.push_back(idle_.front());
+            }
+            idle_.pop_front();
+        }
+        connCount_ -= expired.size();
+        int missing = 0;
+        int target = IsReady() ? minConn_ : max(minConn_, 1);
+        if(connCount_ < target && now >= nextConnect_) {
+            missing = target - connCount_;
+            connCount_ += missing;
+        }
+        locker.unlock();
+
+        for(MYSQL* sql: expired) {
+            Disconnect_(sql);
+        }
+        int failed = 0;
+        vector<IdleConn_> alive;
+        for(auto& conn: checking) {
+            if(mysql_ping(conn.sql) == 0) {
+                alive.push_back(conn);
+            } else {
+                LOG_WARN("MySql connection broken: %s", mysql_error(conn.sql));
+                Disconnect_(conn.sql);
+                failed++;
+            }
+        }
+        vector<MYSQL*> fresh;
+        for(int i = 0; i < missing; i++) {
+            MYSQL* sql = Connect_();
+            if(!sql) {
+                failed += missing - i;
+                break;
+            }
+            fresh.push_back(sql);
+        }
+
+        locker.lock();
+        connCount_ -= failed;
+        if(isClose_) {
+            /* 检查期间连接池已关闭，取出的连接由本线程关闭 */
+            connCount_ -= alive.size() + fresh.size();
+            locker.unlock();
+            for(auto& conn: alive) { Disconnect_(conn.sql); }
+            for(MYSQL* sql: fresh) { Disconnect_(sql); }
+            return;
+        }
+        if(fresh.size() < static_cast<size_t>(missing)) {
+            Backoff_();
+        }
+        /* 检查过的连接保持原有的最近使用时间放回队首，新连接放队尾 */
+        for(auto it = alive.rbegin(); it != alive.rend(); ++it) {
+            idle_.push_front(*it);
+        }
+        for(MYSQL* sql: fresh) {
+            idle_.push_back({sql, Clock_::now()});
+        }
+        if(!alive.empty() || !fresh.empty() || failed > 0 || !expired.empty()) {
+            cond_.notify_all();
+        }
+    }
+}
+
+SqlConnPool::StmtCache_* SqlConnPool::FindStmtCache_(MYSQL* sql) {
     lock_guard<mutex> locker(mtx_);
-    connQue_.push(sql);
-    sem_post(&semId_);  //信号量加1
+    auto it = stmtCache_.find(sql);
+    return it == stmtCache_.end() ? nullptr : &it->second;
+}
+
+MYSQL_STMT* SqlConnPool::GetStmt(MYSQL* sql, const string& query) {
+    StmtCache_* cache = FindStmtCache_(sql);
+    if(!cache) { return nullptr; }
+    if(cache->threadId != mysql_thread_id(sql)) {
+        /* 服务端连接已换(自动重连)，旧语句句柄作废 */
+        ResetStmts(sql);
+        cache->threadId = mysql_thread_id(sql);
+    }
+    auto st = cache->stmts.find(query);
+    if(st != cache->stmts.end()) {
+        return st->second;
+    }
+    MYSQL_STMT* stmt = mysql_stmt_init(sql);
+    if(!stmt) {
+        LOG_ERROR("MySql stmt init error!");
+        return nullptr;
+    }
+    if(mysql_stmt_prepare(stmt, query.data(), query.size())) {
+        LOG_ERROR("MySql prepare error: %s", mysql_stmt_error(stmt));
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+    cache->stmts[query] = stmt;
+    return stmt;
+}
+
+void SqlConnPool::ResetStmts(MYSQL* sql) {
+    StmtCache_* cache = FindStmtCache_(sql);
+    if(!cache) { return; }
+    for(auto& item: cache->stmts) {
+        mysql_stmt_close(item.second);
+    }
+    cache->stmts.clear();
 }
 
 void SqlConnPool::ClosePool() {
-    lock_guard<mutex> locker(mtx_);
-    while(!connQue_.empty()) {
-        auto item = connQue_.front();
-        connQue_.pop();
-        mysql_close(item);
+    deque<IdleConn_> idle;
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(isClose_) { return; }
+        isClose_ = true;
+        idle.swap(idle_);
+        connCount_ -= idle.size();
+        cond_.notify_all();
+        checkCond_.notify_all();
+    }
+    if(healthThread_.joinable()) {
+        healthThread_.join();
+    }
+    for(auto& conn: idle) {
+        Disconnect_(conn.sql);
     }
-    mysql_library_end(); //终止使用mysql数据库，对于涉及客户端库的使用，提供改进的内存管理       
 }
 
 int SqlConnPool::GetFreeConnCount() {
     lock_guard<mutex> locker(mtx_);
-    return connQue_.size();
+    return idle_.size();
+}
+
+int SqlConnPool::GetConnCount() {
+    lock_guard<mutex> locker(mtx_);
+    return connCount_;
+}
+
+int SqlConnPool::GetUseCount() {
+    lock_guard<mutex> locker(mtx_);
+    return useCount_;
 }
 
 SqlConnPool::~SqlConnPool() {
     ClosePool();
 }
-
@@ -2,43 +2,101 @@
  * @Author       : mark
  * @Date         : 2020-06-16
  * @copyleft Apache 2.0
- */ 
+ */
 #ifndef SQLCONNPOOL_H
 #define SQLCONNPOOL_H
 
 #include <mysql/mysql.h>
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 #include <mutex>
-#include <semaphore.h>
+#include <condition_variable>
+#include <chrono>
 #include <thread>
+#include <atomic>
 #include "../log/log.h"
+#include "../metrics/metrics.h"
 
+/* 弹性连接池：保持minConn个连接，不够时按需增长到maxConn；
+   取连接最多等待waitMs，后台线程定期ping空闲连接，断开的重连或淘汰，长期空闲的收缩回minConn。
+   Init不阻塞，初始连接由后台线程并行建立，IsReady()之前查库的请求应直接拒绝 */
 class SqlConnPool {
 public:
-    static SqlConnPool *Instance();  //单例模式，确保一个类只有一个实例
+    static SqlConnPool *Instance();  //主库连接池；只读副本的连接池由SqlRouter各自创建
 
-    MYSQL *GetConn(); //获得一个空闲的数据库连接
+    SqlConnPool();
+    ~SqlConnPool();
+
+    MYSQL *GetConn(); //获得一个空闲的数据库连接，超时返回nullptr
+    MYSQL *GetConn(int timeoutMs);
     void FreeConn(MYSQL * conn); //释放数据库连接
     int GetFreeConnCount(); //得到空闲数据库连接的数量
+    int GetConnCount(); //已打开的连接数(含正在使用的)
+    int GetUseCount(); //正在使用的连接数
+    int GetMaxConn() const { return maxConn_; }
+    bool IsReady() const { return ready_.load(std::memory_order_acquire); } //至少建立过一个连接
+
+    /* 取该连接上缓存的预编译语句，首次使用或连接重连后(thread id变化)重新预编译。
+       只能由当前持有该连接的线程调用 */
+    MYSQL_STMT* GetStmt(MYSQL* sql, const std::string& query);
+    void ResetStmts(MYSQL* sql); //连接断开后语句句柄全部失效，关闭并清空
 
     void Init(const char* host, int port,
-              const char* user,const char* pwd, 
+              const char* user,const char* pwd,
               const char* dbName, int connSize);
+    void Init(const char* host, int port,
+              const char* user,const char* pwd,
+              const char* dbName, int minConn, int maxConn,
+              int waitMs = 1000);
     void ClosePool(); //关闭数据库连接池
 
 private:
-    SqlConnPool();
-    ~SqlConnPool();
 
-    int MAX_CONN_;
+    typedef std::chrono::steady_clock Clock_;
+
+    struct IdleConn_ {
+        MYSQL* sql;
+        Clock_::time_point lastUsed;
+    };
+
+    struct StmtCache_ {
+        unsigned long threadId = 0;
+        std::unordered_map<std::string, MYSQL_STMT*> stmts;
+    };
+
+    MYSQL* Connect_(unsigned int timeoutSec = CONNECT_TIMEOUT_SEC); //新建连接，失败返回nullptr，不持锁调用
+    void Disconnect_(MYSQL* sql);
+    void Backoff_();
+    StmtCache_* FindStmtCache_(MYSQL* sql);
+    void Warmup_();
+    void HealthCheck_();
+
+    static const int CONNECT_TIMEOUT_SEC = 3;      // 建连超时，MySQL客户端只支持整秒
+    static const int CONNECT_RETRY_MS = 1000;      // 建连失败后的退避时间
+    static const int CHECK_INTERVAL_MS = 10000;    // 健康检查周期
+    static const int IDLE_TIMEOUT_MS = 300000;     // 超过minConn的连接空闲这么久后关闭
+
+    std::string host_, user_, pwd_, dbName_;
+    int port_;
+
+    int minConn_;
+    int maxConn_;
+    int waitMs_;
+    int connCount_;  //已打开+正在建立/检查的连接数，不超过maxConn_
     int useCount_;
-    int freeCount_;
+    bool isClose_;
+    std::atomic<bool> ready_;
+    Clock_::time_point nextConnect_;
 
-    std::queue<MYSQL *> connQue_;
+    std::deque<IdleConn_> idle_; //队尾最近归还，优先复用；队首最久未用，检查和收缩都从队首开始
+    std::unordered_map<MYSQL*, StmtCache_> stmtCache_; //增删都在mtx_下，节点地址不变，持有者取到后锁外使用
     std::mutex mtx_;
-    sem_t semId_;
+    std::condition_variable cond_;       //等连接的线程
+    std::condition_variable checkCond_;  //健康检查线程，和cond_分开避免归还连接的通知被它吃掉
+    std::thread healthThread_;
 };
 
 
-#endif // SQLCONNPOOL_H
\ No newline at end of file
+#endif // SQLCONNPOOL_H
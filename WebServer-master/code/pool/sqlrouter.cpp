@@ -0,0 +1,139 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-14
+ * @copyleft Apache 2.0
+ */
+#include "sqlrouter.h"
+#include <stdlib.h>
+#include <random>
+
+using namespace std;
+
+SqlRouter* SqlRouter::Instance() {
+    static SqlRouter router;
+    return &router;
+}
+
+SqlRouter::~SqlRouter() {
+    Close();
+}
+
+void SqlRouter::Init(const string& replicas, const char* user, const char* pwd,
+                     const char* dbName, int connPerReplica) {
+    assert(backends_.empty());
+    size_t begin = 0;
+    while(begin < replicas.size()) {
+        size_t end = replicas.find(',', begin);
+        if(end == string::npos) { end = replicas.size(); }
+        string item = replicas.substr(begin, end - begin);
+        begin = end + 1;
+        size_t colon = item.rfind(':');
+        if(item.empty() || colon == string::npos) {
+            if(!item.empty()) { LOG_ERROR("Bad replica address: %s", item.c_str()); }
+            continue;
+        }
+        unique_ptr<Backend_> b(new Backend_());
+        b->host = item.substr(0, colon);
+        b->port = atoi(item.c_str() + colon + 1);
+        b->mock = false;
+        b->ewmaNs = 0;
+        b->inflight = 0;
+        b->downUntil = 0;
+        b->lastPick = 0;
+        b->pool.Init(b->host.c_str(), b->port, user, pwd, dbName,
+                     max(1, connPerReplica / 4), connPerReplica);
+        LOG_INFO("MySql replica %s:%d", b->host.c_str(), b->port);
+        backends_.push_back(std::move(b));
+    }
+}
+
+void SqlRouter::Close() {
+    for(auto& b: backends_) {
+        b->pool.ClosePool();
+    }
+}
+
+void SqlRouter::AddMockBackends(int n) {
+    for(int i = 0; i < n; i++) {
+        unique_ptr<Backend_> b(new Backend_());
+        b->host = "mock";
+        b->port = static_cast<int>(backends_.size());
+        b->mock = true;
+        b->ewmaNs = 0;
+        b->inflight = 0;
+        b->downUntil = 0;
+        b->lastPick = 0;
+        backends_.push_back(std::move(b));
+    }
+}
+
+SqlConnPool* SqlRouter::Pool(int backend) {
+    if(backend == PRIMARY) {
+        return SqlConnPool::Instance();
+    }
+    return &backends_[backend]->pool;
+}
+
+bool SqlRouter::IsUp_(const Backend_& b, uint64_t now) const {
+    return (b.mock || b.pool.IsReady()) && b.downUntil.load(memory_order_relaxed) <= now;
+}
+
+uint64_t SqlRouter::Score_(const Backend_& b, uint64_t now) const {
+    if(b.lastPick.load(memory_order_relaxed) + PROBE_NS <= now) {
+        return 0;
+    }
+    return (b.ewmaNs.load(memory_order_relaxed) + 1) *
+           (b.inflight.load(memory_order_relaxed) + 1);
+}
+
+int SqlRouter::PickReader(int exclude) {
+    uint64_t now = MonoNs();
+    int up[2] = { PRIMARY, PRIMARY };
+    int upCount = 0;
+    /* 从随机位置开始取前两个可用副本，相当于随机两选一 */
+    static thread_local minstd_rand rng(random_device{}());
+    int n = backends_.size();
+    int start = n ? rng() % n : 0;
+    for(int k = 0; k < n && upCount < 2; k++) {
+        int i = (start + k) % n;
+        if(i != exclude && IsUp_(*backends_[i], now)) {
+            up[upCount++] = i;
+        }
+    }
+    int pick = up[0];
+    if(upCount == 2 && Score_(*backends_[up[1]], now) < Score_(*backends_[up[0]], now)) {
+        pick = up[1];
+    }
+    if(pick != PRIMARY) {
+        backends_[pick]->inflight.fetch_add(1, memory_order_relaxed);
+        backends_[pick]->lastPick.store(now, memory_order_relaxed);
+    }
+    return pick;
+}
+
+void SqlRouter::Report(int backend, uint64_t ns, bool ok) {
+    if(backend == PRIMARY) { return; }
+    Backend_& b = *backends_[backend];
+    b.inflight.fetch_sub(1, memory_order_relaxed);
+    if(!ok) {
+        b.downUntil.store(MonoNs() + DOWN_NS, memory_order_relaxed);
+        LOG_WARN_RL("MySql replica %s:%d failed, skip for 1s", b.host.c_str(), b.port);
+        return;
+    }
+    /* 并发更新偶尔丢一个样本无妨，不用CAS */
+    uint64_t old = b.ewmaNs.load(memory_order_relaxed);
+    uint64_t ewma = old ? old - (old >> EWMA_SHIFT) + (ns >> EWMA_SHIFT) : ns;
+    b.ewmaNs.store(ewma, memory_order_relaxed);
+}
+
+bool SqlRouter::AnyReady() {
+    for(auto& b: backends_) {
+        if(b->pool.IsReady()) { return true; }
+    }
+    return false;
+}
+
+string SqlRouter::Label(int backend) const {
+    const Backend_& b = *backends_[backend];
+    return "backend=\"" + b.host + ":" + to_string(b.port) + "\"";
+}
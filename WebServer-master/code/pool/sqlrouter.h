@@ -0,0 +1,72 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-14
+ * @copyleft Apache 2.0
+ */
+#ifndef SQLROUTER_H
+#define SQLROUTER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+#include "sqlconnpool.h"
+
+/* 读写分离：写走主库(SqlConnPool::Instance())，只读查询在副本间负载均衡。
+   每个副本一个连接池，按延迟EWMA*(在途请求+1)做两选一；出错的副本暂时摘除，
+   没有可用副本时回落到主库 */
+class SqlRouter {
+public:
+    static SqlRouter* Instance();
+
+    static const int PRIMARY = -1;
+
+    /* replicas为"host:port,host:port"，为空时所有读都走主库 */
+    void Init(const std::string& replicas, const char* user, const char* pwd,
+              const char* dbName, int connPerReplica);
+    void Close();
+    /* 测试用：追加n个不连数据库、始终视为就绪的后端，检验选择和摘除逻辑 */
+    void AddMockBackends(int n);
+
+    /* 选一个读后端，跳过exclude(上一次失败的)；返回PRIMARY表示主库。
+       每次PickReader之后必须调用一次Report */
+    int PickReader(int exclude = PRIMARY);
+    void Report(int backend, uint64_t ns, bool ok);
+
+    SqlConnPool* Pool(int backend);
+    size_t ReplicaCount() const { return backends_.size(); }
+    bool AnyReady();
+
+    /* 指标用 */
+    std::string Label(int backend) const;
+    uint64_t LatencyNs(int backend) const { return backends_[backend]->ewmaNs.load(std::memory_order_relaxed); }
+    int Inflight(int backend) const { return backends_[backend]->inflight.load(std::memory_order_relaxed); }
+    bool IsUp(int backend) const { return IsUp_(*backends_[backend], MonoNs()); }
+
+private:
+    SqlRouter() = default;
+    ~SqlRouter();
+
+    struct Backend_ {
+        std::string host;
+        int port;
+        SqlConnPool pool;
+        bool mock;
+        std::atomic<uint64_t> ewmaNs;
+        std::atomic<int> inflight;
+        std::atomic<uint64_t> downUntil;   // MonoNs，之前不参与选择
+        std::atomic<uint64_t> lastPick;    // MonoNs，太久没被选中时按0分探测一次，让EWMA跟上恢复
+    };
+
+    bool IsUp_(const Backend_& b, uint64_t now) const;
+    uint64_t Score_(const Backend_& b, uint64_t now) const;
+
+    static const int EWMA_SHIFT = 3;            // 新样本权重1/8
+    static const uint64_t DOWN_NS = 1000000000; // 出错后摘除1秒
+    static const uint64_t PROBE_NS = 1000000000; // 超过1秒没被选中的副本优先选一次
+
+    std::vector<std::unique_ptr<Backend_>> backends_;   // Init后不再增删
+};
+
+#endif //SQLROUTER_H
@@ -2,7 +2,7 @@
  * @Author       : mark
  * @Date         : 2020-06-15
  * @copyleft Apache 2.0
- */ 
+ */
 
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
@@ -12,6 +12,9 @@
 #include <queue>
 #include <thread>
 #include <functional>
+#include <chrono>
+#include <math.h>
+#include <stdint.h>
 class ThreadPool {
 public:
     explicit ThreadPool(size_t threadCount = 8): pool_(std::make_shared<Pool>()) {
@@ -23,10 +26,16 @@ public:
                         if(!pool->tasks.empty()) {
                             auto task = std::move(pool->tasks.front());
                             pool->tasks.pop();
+                            /* 带drop回调的任务才可能被丢弃，丢弃时执行drop代替原任务 */
+                            uint64_t now = NowNs_();
+                            bool drop = task.drop && pool->ShouldDrop(now - task.enqueueNs, now);
+                            pool->busy++;
                             locker.unlock();
-                            task();
+                            if(drop) { task.drop(); }
+                            else { task.run(); }
                             locker.lock();
-                        } 
+                            pool->busy--;
+                        }
                         else if(pool->isClosed) break;
                         else pool->cond.wait(locker);
                     }
@@ -37,7 +46,7 @@ public:
     ThreadPool() = default;
 
     ThreadPool(ThreadPool&&) = default;
-    
+
     ~ThreadPool() {
         if(static_cast<bool>(pool_)) {
             {
@@ -48,24 +57,134 @@ public:
         }
     }
 
+    /* CoDel：任务排队时间持续interval超过target后开始丢弃，丢弃间隔按interval/sqrt(n)缩短，
+       排队时间回落到target以下即停止。targetMs为0时关闭(默认) */
+    void SetCodel(int targetMs, int intervalMs) {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        pool_->targetNs = static_cast<uint64_t>(targetMs) * 1000000;
+        pool_->intervalNs = static_cast<uint64_t>(intervalMs) * 1000000;
+    }
+
     template<class F>
     void AddTask(F&& task) {
         {
             std::lock_guard<std::mutex> locker(pool_->mtx);
-            pool_->tasks.emplace(std::forward<F>(task));
+            pool_->tasks.push({ std::forward<F>(task), nullptr, NowNs_() });
+        }
+        pool_->cond.notify_one();
+    }
+
+    /* drop：排队太久被丢弃时代替task执行，应当只做很少的事(如回503) */
+    template<class F, class D>
+    void AddTask(F&& task, D&& drop) {
+        {
+            std::lock_guard<std::mutex> locker(pool_->mtx);
+            pool_->tasks.push({ std::forward<F>(task), std::forward<D>(drop), NowNs_() });
+        }
+        pool_->cond.notify_one();
+    }
+
+    /* 队列已有maxQueue个任务时拒绝，由调用方决定如何回应(如503)，不让积压无限增长 */
+    template<class F>
+    bool TryAddTask(F&& task, size_t maxQueue) {
+        return TryAddTask(std::forward<F>(task), nullptr, maxQueue);
+    }
+
+    template<class F, class D>
+    bool TryAddTask(F&& task, D&& drop, size_t maxQueue) {
+        {
+            std::lock_guard<std::mutex> locker(pool_->mtx);
+            if(pool_->tasks.size() >= maxQueue) { return false; }
+            pool_->tasks.push({ std::forward<F>(task), std::forward<D>(drop), NowNs_() });
         }
         pool_->cond.notify_one();
+        return true;
+    }
+
+    /* 正在执行任务的线程数 */
+    size_t BusyCount() {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        return pool_->busy;
+    }
+
+    size_t QueueSize() {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        return pool_->tasks.size();
+    }
+
+    /* CoDel累计丢弃的任务数 */
+    uint64_t DropCount() {
+        std::lock_guard<std::mutex> locker(pool_->mtx);
+        return pool_->dropCount;
     }
 
 private:
+    static uint64_t NowNs_() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct Task {
+        std::function<void()> run;
+        std::function<void()> drop;
+        uint64_t enqueueNs;
+    };
+
     struct Pool {
         std::mutex mtx;
         std::condition_variable cond;
         bool isClosed;
-        std::queue<std::function<void()>> tasks;
+        size_t busy = 0;
+        std::queue<Task> tasks;
+
+        /* CoDel状态，都在mtx下读写 */
+        uint64_t targetNs = 0;
+        uint64_t intervalNs = 0;
+        uint64_t firstAboveNs = 0;  // 排队时间超过target后，持续到这个时刻才开始丢弃
+        uint64_t dropNextNs = 0;
+        uint32_t dropCountInRun = 0;
+        bool dropping = false;
+        uint64_t dropCount = 0;
+
+        /* 持锁调用，任务刚出队，sojourn为它的排队时间 */
+        bool ShouldDrop(uint64_t sojourn, uint64_t now);
+        uint64_t ControlLaw(uint64_t t) const {
+            return t + static_cast<uint64_t>(intervalNs / sqrt(static_cast<double>(dropCountInRun)));
+        }
     };
     std::shared_ptr<Pool> pool_;
 };
 
+inline bool ThreadPool::Pool::ShouldDrop(uint64_t sojourn, uint64_t now) {
+    if(targetNs == 0) { return false; }
+    bool okToDrop = false;
+    /* 队列已空说明积压已经消化，不丢最后一个 */
+    if(sojourn < targetNs || tasks.empty()) {
+        firstAboveNs = 0;
+    } else if(firstAboveNs == 0) {
+        firstAboveNs = now + intervalNs;
+    } else if(now >= firstAboveNs) {
+        okToDrop = true;
+    }
+
+    if(dropping) {
+        if(!okToDrop) {
+            dropping = false;
+            return false;
+        }
+        if(now < dropNextNs) { return false; }
+        dropCountInRun++;
+        dropNextNs = ControlLaw(dropNextNs);
+        dropCount++;
+        return true;
+    }
+    if(!okToDrop) { return false; }
+    /* 刚退出丢弃状态不久又进入，从上次的丢弃频率附近继续 */
+    dropping = true;
+    dropCountInRun = (dropCountInRun > 2 && now < dropNextNs + 16 * intervalNs) ? dropCountInRun - 2 : 1;
+    dropNextNs = ControlLaw(now);
+    dropCount++;
+    return true;
+}
 
-#endif //THREADPOOL_H
\ No newline at end of file
+#endif //THREADPOOL_H
@@ -0,0 +1,176 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-08
+ * @copyleft Apache 2.0
+ */
+#include "usercache.h"
+#include <random>
+#include <string.h>
+#include <ctype.h>
+
+using namespace std;
+
+/* SipHash-2-4：带密钥的64位摘要，密钥不泄露时无法从摘要反推或离线撞口令 */
+static inline uint64_t Rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+static inline void SipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = Rotl(v1, 13); v1 ^= v0; v0 = Rotl(v0, 32);
+    v2 += v3; v3 = Rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = Rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = Rotl(v1, 17); v1 ^= v2; v2 = Rotl(v2, 32);
+}
+
+static uint64_t SipHash24(const uint64_t key[2], const char* data, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    size_t end = len - len % 8;
+    for(size_t i = 0; i < end; i += 8) {
+        uint64_t m;
+        memcpy(&m, data + i, 8);
+        v3 ^= m;
+        SipRound(v0, v1, v2, v3);
+        SipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t b = static_cast<uint64_t>(len) << 56;
+    for(size_t i = 0; i < len % 8; i++) {
+        b |= static_cast<uint64_t>(static_cast<unsigned char>(data[end + i])) << (8 * i);
+    }
+    v3 ^= b;
+    SipRound(v0, v1, v2, v3);
+    SipRound(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for(int i = 0; i < 4; i++) { SipRound(v0, v1, v2, v3); }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+UserCache::UserCache() {
+    ignoreCase_ = false;
+    random_device rd;
+    key_[0] = (static_cast<uint64_t>(rd()) << 32) | rd();
+    key_[1] = (static_cast<uint64_t>(rd()) << 32) | rd();
+    Init(4096, 300000, 30000);
+}
+
+UserCache* UserCache::Instance() {
+    static UserCache inst;
+    return &inst;
+}
+
+void UserCache::Init(size_t capacity, int ttlMs, int negativeTtlMs) {
+    shardCapacity_ = capacity / SHARD_NUM > 0 ? capacity / SHARD_NUM : 1;
+    ttlMs_ = ttlMs;
+    negativeTtlMs_ = negativeTtlMs;
+}
+
+string UserCache::Key_(const string& name) const {
+    string key = name;
+    if(ignoreCase_) {
+        for(char& c: key) { c = tolower(static_cast<unsigned char>(c)); }
+    }
+    return key;
+}
+
+UserCache::Shard_& UserCache::ShardOf_(const string& key) {
+    return shards_[hash<string>()(key) % SHARD_NUM];
+}
+
+uint64_t UserCache::Digest_(const string& name, const string& pwd) const {
+    string msg;
+    msg.reserve(name.size() + pwd.size() + 1);
+    msg.append(name).push_back('\0');
+    msg.append(pwd);
+    return SipHash24(key_, msg.data(), msg.size());
+}
+
+UserCache::RESULT UserCache::Lookup(const string& name, const string& pwd) {
+    string key = Key_(name);
+    Shard_& shard = ShardOf_(key);
+    uint64_t digest = Digest_(key, pwd);   // 锁外计算
+    lock_guard<mutex> locker(shard.mtx);
+    auto it = shard.index.find(key);
+    if(it == shard.index.end()) {
+        return MISS;
+    }
+    auto node = it->second;
+    if(node->expires <= Clock_::now()) {
+        shard.lru.erase(node);
+        shard.index.erase(it);
+        return MISS;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, node);
+    if(node->absent) {
+        return ABSENT;
+    }
+    /* 口令不符不能断定失败(可能库里改过密码)，交给数据库判定 */
+    return node->digest == digest ? VERIFIED : MISS;
+}
+
+/* 需持有shard.mtx */
+void UserCache::Put_(Shard_& shard, const string& name, uint64_t digest, bool absent, int ttlMs) {
+    if(ttlMs <= 0) { return; }
+    Clock_::time_point expires = Clock_::now() + chrono::milliseconds(ttlMs);
+    auto it = shard.index.find(name);
+    if(it != shard.index.end()) {
+        auto node = it->second;
+        node->digest = digest;
+        node->absent = absent;
+        node->expires = expires;
+        shard.lru.splice(shard.lru.begin(), shard.lru, node);
+        return;
+    }
+    shard.lru.push_front({name, digest, absent, expires});
+    shard.index[name] = shard.lru.begin();
+    while(shard.lru.size() > shardCapacity_) {
+        shard.index.erase(shard.lru.back().name);
+        shard.lru.pop_back();
+    }
+}
+
+void UserCache::PutVerified(const string& name, const string& pwd) {
+    string key = Key_(name);
+    Shard_& shard = ShardOf_(key);
+    uint64_t digest = Digest_(key, pwd);
+    lock_guard<mutex> locker(shard.mtx);
+    Put_(shard, key, digest, false, ttlMs_);
+}
+
+uint64_t UserCache::Version(const string& name) {
+    Shard_& shard = ShardOf_(Key_(name));
+    lock_guard<mutex> locker(shard.mtx);
+    return shard.version;
+}
+
+void UserCache::PutAbsent(const string& name, uint64_t version) {
+    string key = Key_(name);
+    Shard_& shard = ShardOf_(key);
+    lock_guard<mutex> locker(shard.mtx);
+    if(shard.version != version) { return; }
+    Put_(shard, key, 0, true, negativeTtlMs_);
+}
+
+void UserCache::Invalidate(const string& name) {
+    string key = Key_(name);
+    Shard_& shard = ShardOf_(key);
+    lock_guard<mutex> locker(shard.mtx);
+    shard.version++;
+    auto it = shard.index.find(key);
+    if(it != shard.index.end()) {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+}
+
+size_t UserCache::Size() {
+    size_t n = 0;
+    for(auto& shard: shards_) {
+        lock_guard<mutex> locker(shard.mtx);
+        n += shard.lru.size();
+    }
+    return n;
+}
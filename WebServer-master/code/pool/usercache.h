@@ -0,0 +1,79 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-08
+ * @copyleft Apache 2.0
+ */
+#ifndef USERCACHE_H
+#define USERCACHE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <unordered_map>
+#include <stdint.h>
+
+/* 挡在UserVerify查库前面的用户缓存：按用户名分片，每片一把锁+LRU链表，条目带过期时间。
+   只保存校验通过的口令的带密钥摘要(SipHash)，不保存明文；不存在的用户做负缓存 */
+class UserCache {
+public:
+    enum RESULT {
+        MISS = 0,       // 未命中或口令与缓存摘要不符，需要查库
+        VERIFIED,       // 口令与缓存的已验证摘要一致
+        ABSENT,         // 负缓存：用户不存在
+    };
+
+    static UserCache* Instance();
+
+    void Init(size_t capacity, int ttlMs, int negativeTtlMs);
+    /* 后端用户名不区分大小写时开启，各接口先把用户名转成ASCII小写再作键，
+       否则Mark的负缓存会挡住已注册的mark。启动时设置一次 */
+    void SetIgnoreCase(bool ignoreCase) { ignoreCase_ = ignoreCase; }
+
+    RESULT Lookup(const std::string& name, const std::string& pwd);
+
+    void PutVerified(const std::string& name, const std::string& pwd);
+
+    /* 负缓存要防和注册交错：查库前取Version，查到不存在后带着它PutAbsent；
+       期间有Invalidate(注册成功)则版本已变，不写入，否则刚注册的用户会被挡在外面直到过期 */
+    uint64_t Version(const std::string& name);
+    void PutAbsent(const std::string& name, uint64_t version);
+    void Invalidate(const std::string& name);
+
+    size_t Size();
+
+private:
+    typedef std::chrono::steady_clock Clock_;
+
+    struct Entry_ {
+        std::string name;
+        uint64_t digest;
+        bool absent;
+        Clock_::time_point expires;
+    };
+
+    struct Shard_ {
+        std::mutex mtx;
+        std::list<Entry_> lru;  // 表头最近使用
+        std::unordered_map<std::string, std::list<Entry_>::iterator> index;
+        uint64_t version = 0;   // 每次Invalidate加一，按分片计，同片其他用户注册时只是少缓存一次
+    };
+
+    UserCache();
+
+    std::string Key_(const std::string& name) const;
+    Shard_& ShardOf_(const std::string& key);
+    uint64_t Digest_(const std::string& name, const std::string& pwd) const;
+    void Put_(Shard_& shard, const std::string& name, uint64_t digest, bool absent, int ttlMs);
+
+    static const int SHARD_NUM = 16;
+
+    Shard_ shards_[SHARD_NUM];
+    size_t shardCapacity_;
+    int ttlMs_;
+    int negativeTtlMs_;
+    bool ignoreCase_;
+    uint64_t key_[2];   // 进程启动时随机生成的摘要密钥
+};
+
+#endif //USERCACHE_H
@@ -0,0 +1,243 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-20
+ * @copyleft Apache 2.0
+ */
+#include "ipfilter.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "../log/log.h"
+#include "../metrics/metrics.h"
+
+using namespace std;
+
+const uint32_t IpFilter::NONE;
+const uint32_t IpFilter::ALLOW;
+const uint32_t IpFilter::DENY;
+const uint32_t IpFilter::PTR;
+
+IpFilter::IpFilter(): table_(nullptr), epoch_(0), isClose_(false) {}
+
+IpFilter::~IpFilter() {
+    Close();
+    delete table_.load();
+}
+
+IpFilter* IpFilter::Instance() {
+    static IpFilter inst;
+    return &inst;
+}
+
+bool IpFilter::Allow(in_addr_t ip) const {
+    const Table_* t = table_.load(memory_order_acquire);
+    if(!t) { return true; }
+    uint32_t a = ntohl(ip);
+    uint32_t e = t->root[a >> 16];
+    if(e & PTR) {
+        e = t->sub[(e & ~PTR) + ((a >> 8) & 0xff)];
+        if(e & PTR) {
+            e = t->sub[(e & ~PTR) + (a & 0xff)];
+        }
+    }
+    if(e == NONE) { return t->defaultAllow; }
+    return e == ALLOW;
+}
+
+size_t IpFilter::RuleCount() const {
+    const Table_* t = table_.load(memory_order_acquire);
+    return t ? t->rules : 0;
+}
+
+/* entry还是叶子时，建一块继承它的值的子表，返回子表起始下标 */
+uint32_t IpFilter::Child_(Table_* table, uint32_t* entry) {
+    if(*entry & PTR) { return *entry & ~PTR; }
+    uint32_t base = table->sub.size();
+    table->sub.resize(base + 256, *entry);
+    *entry = PTR | base;
+    return base;
+}
+
+/* 调用方保证按前缀长度从短到长插入，长的覆盖短的即为最长前缀匹配，
+   且涂一段范围时里面不会已有更深的子表 */
+void IpFilter::Insert_(Table_* table, uint32_t prefix, int len, uint32_t action) {
+    if(len <= 16) {
+        uint32_t begin = prefix >> 16;
+        fill(table->root.begin() + begin, table->root.begin() + begin + (1u << (16 - len)), action);
+        return;
+    }
+    uint32_t l2 = Child_(table, &table->root[prefix >> 16]);
+    if(len <= 24) {
+        uint32_t begin = l2 + ((prefix >> 8) & 0xff);
+        fill(table->sub.begin() + begin, table->sub.begin() + begin + (1u << (24 - len)), action);
+        return;
+    }
+    /* Child_可能让sub扩容，先取下标再取引用 */
+    uint32_t l2Idx = l2 + ((prefix >> 8) & 0xff);
+    uint32_t entry = table->sub[l2Idx];
+    uint32_t l3 = Child_(table, &entry);
+    table->sub[l2Idx] = entry;
+    uint32_t begin = l3 + (prefix & 0xff);
+    fill(table->sub.begin() + begin, table->sub.begin() + begin + (1u << (32 - len)), action);
+}
+
+bool IpFilter::Parse_(const string& path, Table_* table) {
+    ifstream in(path);
+    if(!in) {
+        LOG_ERROR("IpFilter: open %s failed", path.c_str());
+        return false;
+    }
+    struct Rule { uint32_t prefix; int len; uint32_t action; };
+    vector<Rule> rules;
+    string line;
+    int lineNo = 0;
+    while(getline(in, line)) {
+        lineNo++;
+        size_t hash = line.find('#');
+        if(hash != string::npos) { line.resize(hash); }
+        istringstream ss(line);
+        string verb, cidr;
+        if(!(ss >> verb)) { continue; }
+        if(!(ss >> cidr)) {
+            LOG_ERROR("IpFilter: %s:%d missing address", path.c_str(), lineNo);
+            return false;
+        }
+        uint32_t action;
+        if(verb == "allow") { action = ALLOW; }
+        else if(verb == "deny") { action = DENY; }
+        else if(verb == "default") {
+            if(cidr != "allow" && cidr != "deny") {
+                LOG_ERROR("IpFilter: %s:%d bad default '%s'", path.c_str(), lineNo, cidr.c_str());
+                return false;
+            }
+            table->defaultAllow = (cidr == "allow");
+            continue;
+        }
+        else {
+            LOG_ERROR("IpFilter: %s:%d unknown rule '%s'", path.c_str(), lineNo, verb.c_str());
+            return false;
+        }
+        if(cidr.find(':') != string::npos) {
+            /* 还不支持IPv6连接，这类规则先跳过 */
+            LOG_WARN("IpFilter: %s:%d IPv6 rule ignored", path.c_str(), lineNo);
+            continue;
+        }
+        int len = 32;
+        size_t slash = cidr.find('/');
+        if(slash != string::npos) {
+            char* end = nullptr;
+            len = strtol(cidr.c_str() + slash + 1, &end, 10);
+            if(*end != '\0' || slash + 1 == cidr.size() || len < 0 || len > 32) {
+                LOG_ERROR("IpFilter: %s:%d bad prefix length", path.c_str(), lineNo);
+                return false;
+            }
+            cidr.resize(slash);
+        }
+        struct in_addr addr;
+        if(inet_pton(AF_INET, cidr.c_str(), &addr) != 1) {
+            LOG_ERROR("IpFilter: %s:%d bad address '%s'", path.c_str(), lineNo, cidr.c_str());
+            return false;
+        }
+        uint32_t mask = len == 0 ? 0 : ~0u << (32 - len);
+        rules.push_back({ ntohl(addr.s_addr) & mask, len, action });
+    }
+    /* 同样长度的保持文件顺序，后写的覆盖先写的 */
+    stable_sort(rules.begin(), rules.end(), [](const Rule& a, const Rule& b) { return a.len < b.len; });
+    table->root.assign(1u << 16, NONE);
+    for(const Rule& r: rules) {
+        Insert_(table, r.prefix, r.len, r.action);
+    }
+    table->rules = rules.size();
+    return true;
+}
+
+bool IpFilter::Load(const string& path) {
+    Table_* table = new Table_;
+    if(!Parse_(path, table)) {
+        delete table;
+        return false;
+    }
+    Publish_(table);
+    LOG_INFO("IpFilter: %zu rules loaded from %s, default %s, %zuKB",
+             table->rules, path.c_str(), table->defaultAllow ? "allow" : "deny",
+             (table->root.size() + table->sub.size()) * sizeof(uint32_t) >> 10);
+    Metrics::Instance()->Inc(IP_FILTER_RELOADS);
+    return true;
+}
+
+void IpFilter::Publish_(Table_* table) {
+    lock_guard<mutex> locker(mtx_);
+    const Table_* old = table_.exchange(table, memory_order_acq_rel);
+    if(old) {
+        retired_.push_back({ old, epoch_.load(memory_order_acquire) });
+    }
+}
+
+/* 退休之后读者又过了一轮，旧表就不会再被访问了 */
+void IpFilter::Reclaim_(bool force) {
+    lock_guard<mutex> locker(mtx_);
+    uint64_t now = epoch_.load(memory_order_acquire);
+    auto it = retired_.begin();
+    while(it != retired_.end()) {
+        if(force || now > it->second) {
+            delete it->first;
+            it = retired_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void IpFilter::Watch(const string& path, int intervalMs) {
+    StopWatch_();
+    lock_guard<mutex> locker(mtx_);
+    isClose_ = false;
+    watchThread_ = thread(&IpFilter::WatchLoop_, this, path, intervalMs);
+}
+
+/* 秒级mtime会漏掉同一秒内的两次修改，带上纳秒、大小和inode(rename替换) */
+static string FileVersion(const string& path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) { return ""; }
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%ld.%09ld:%lld:%lu", (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+             (long long)st.st_size, (unsigned long)st.st_ino);
+    return buf;
+}
+
+void IpFilter::WatchLoop_(string path, int intervalMs) {
+    string lastVersion = FileVersion(path);
+    unique_lock<mutex> locker(mtx_);
+    while(!isClose_) {
+        cond_.wait_for(locker, chrono::milliseconds(intervalMs));
+        if(isClose_) { break; }
+        locker.unlock();
+        Reclaim_(false);
+        string version = FileVersion(path);
+        if(!version.empty() && version != lastVersion) {
+            lastVersion = version;
+            if(!Load(path)) {
+                LOG_ERROR("IpFilter: reload %s failed, keep old rules", path.c_str());
+            }
+        }
+        locker.lock();
+    }
+}
+
+void IpFilter::StopWatch_() {
+    {
+        lock_guard<mutex> locker(mtx_);
+        isClose_ = true;
+    }
+    cond_.notify_all();
+    if(watchThread_.joinable()) { watchThread_.join(); }
+}
+
+/* 读者线程已经停了才能调用 */
+void IpFilter::Close() {
+    StopWatch_();
+    Reclaim_(true);
+}
@@ -0,0 +1,80 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-20
+ * @copyleft Apache 2.0
+ */
+#ifndef IPFILTER_H
+#define IPFILTER_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* accept时按CIDR放行/拒绝的IPv4过滤器。规则文件每行一条：
+       allow 10.0.0.0/8
+       deny  203.0.113.0/24
+       default deny          (不写时默认放行)
+   最长前缀匹配，用16-8-8三级多比特trie展开成数组，查一次最多3次访存。
+   重载时在后台建新表，原子指针替换；读者(事件循环线程)每轮调用Quiescent()，
+   旧表等它过了一轮之后再释放，读路径不加锁 */
+class IpFilter {
+public:
+    static IpFilter* Instance();
+
+    /* 解析并换上新规则，出错时保留旧规则返回false */
+    bool Load(const std::string& path);
+    /* 后台线程定期检查文件修改时间，变了就重载 */
+    void Watch(const std::string& path, int intervalMs = 1000);
+    void Close();
+
+    /* ip为网络字节序；没有加载规则时全部放行 */
+    bool Allow(in_addr_t ip) const;
+
+    /* 只由读者线程在两次查询之间调用，表示不再持有旧表 */
+    void Quiescent() { epoch_.fetch_add(1, std::memory_order_release); }
+
+    size_t RuleCount() const;
+
+private:
+    IpFilter();
+    ~IpFilter();
+
+    struct Table_ {
+        std::vector<uint32_t> root;   // 2^16项，按高16位索引
+        std::vector<uint32_t> sub;    // 256项一块的二三级表
+        bool defaultAllow = true;
+        size_t rules = 0;
+    };
+
+    static bool Parse_(const std::string& path, Table_* table);
+    static void Insert_(Table_* table, uint32_t prefix, int len, uint32_t action);
+    static uint32_t Child_(Table_* table, uint32_t* entry);
+
+    void Publish_(Table_* table);
+    void Reclaim_(bool force);
+    void WatchLoop_(std::string path, int intervalMs);
+    void StopWatch_();
+
+    static const uint32_t NONE = 0;
+    static const uint32_t ALLOW = 1;
+    static const uint32_t DENY = 2;
+    static const uint32_t PTR = 1u << 31;   // 置位时低位为子表在sub中的起始下标
+
+    std::atomic<const Table_*> table_;
+    std::atomic<uint64_t> epoch_;
+
+    std::mutex mtx_;   // 只保护写者之间和退休列表，读路径不用
+    std::vector<std::pair<const Table_*, uint64_t>> retired_;  // 旧表及其退休时的epoch
+
+    bool isClose_;
+    std::condition_variable cond_;
+    std::thread watchThread_;
+};
+
+#endif //IPFILTER_H
@@ -6,16 +6,29 @@ WebServer::WebServer(
             int port, int trigMode, int timeoutMS, bool OptLinger,
             int sqlPort, const char* sqlUser, const  char* sqlPwd,
             const char* dbName, int connPoolNum, int threadNum,
-            bool openLog, int logLevel, int logQueSize):
-            port_(port), openLinger_(OptLinger), timeoutMS_(timeoutMS), isClose_(false),
-            timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)), epoller_(new Epoller())
+            bool openLog, int logLevel, int logQueSize,
+            int userStore, const char* userStorePath, const char* sqlReplicas,
+            int maxConn, int maxBufferMB, int maxBacklog, int rateLimit, int rateBurst,
+            const char* ipFilterPath, int keepAliveMS, int keepAliveMax):
+            port_(port), openLinger_(OptLinger), timeoutMS_(timeoutMS), keepAliveMS_(keepAliveMS), isClose_(false),
+            maxConn_(maxConn), maxBufferBytes_(static_cast<size_t>(maxBufferMB) << 20), maxBacklog_(maxBacklog),
+            acceptPaused_(false),
+            accepted_(Metrics::Instance()->Sum(CONN_CLOSED)), closedSeen_(accepted_),
+            timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)),
+            dbpool_(new ThreadPool(connPoolNum)), epoller_(new Epoller())
     {
     srcDir_ = getcwd(nullptr, 256);  //getcwd返回当前工作目录
     assert(srcDir_);
     strncat(srcDir_, "/resources/", 16);  //strncat字符串追加，最大追加16字符
-    HttpConn::userCount = 0;  //静态变量，原子操作
     HttpConn::srcDir = srcDir_; //静态变量
-    SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName, connPoolNum);  //单例模式，确保一个sql线程池实例
+    if(maxConn_ > MAX_FD) { maxConn_ = MAX_FD; }
+    /* 排到STATIC_QUEUE_MAX时读事件已经被直接丢弃，暂停accept要在这之前 */
+    if(maxBacklog_ <= 0 || maxBacklog_ > STATIC_QUEUE_MAX) { maxBacklog_ = STATIC_QUEUE_MAX; }
+    HttpConn::SetKeepAlive(keepAliveMax, keepAliveMS_);
+    threadpool_->SetCodel(STATIC_CODEL_TARGET_MS, STATIC_CODEL_INTERVAL_MS);
+    dbpool_->SetCodel(DB_CODEL_TARGET_MS, DB_CODEL_INTERVAL_MS);
+    RateLimiter::Instance()->Init(rateLimit, rateBurst);
+    InitMetrics_();
 
     InitEventMode_(trigMode);   //初始化服务器的事件模式
     if(!InitSocket_()) { isClose_ = true;} //初始化socket失败，关闭连接
@@ -31,17 +44,111 @@ WebServer::WebServer(
                             (connEvent_ & EPOLLET ? "ET": "LT"));
             LOG_INFO("LogSys level: %d", logLevel);   //日志级别，只有不低于level时才会被输出
             LOG_INFO("srcDir: %s", HttpConn::srcDir);
-            LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d", connPoolNum, threadNum);
+            LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d, DB thread num: %d", connPoolNum, threadNum, connPoolNum);
+            LOG_INFO("Admission: max conn %d, max buffer %dMB, max backlog %d", maxConn_, maxBufferMB, maxBacklog_);
+            LOG_INFO("Rate limit per IP: %d/s, burst %d", rateLimit, rateBurst);
+            LOG_INFO("Keep-alive: max %d requests, idle timeout %dms", HttpConn::keepAliveMax, keepAliveMS_);
         }
     }
 
+    /* 内嵌存储不需要数据库连接 */
+    if(userStore == UserStore::MYSQL_STORE) {
+        /* 常驻connPoolNum/4个连接，按需增长到connPoolNum，和数据库线程数一致。
+           Init不阻塞，监听socket已打开，静态资源不用等数据库 */
+        SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName,
+                                      max(1, connPoolNum / 4), connPoolNum);  //单例模式，确保一个sql线程池实例
+        /* 只读副本各自一个同样大小的连接池，登录查询在副本间分摊 */
+        SqlRouter::Instance()->Init(sqlReplicas ? sqlReplicas : "", sqlUser, sqlPwd, dbName, connPoolNum);
+        InitReplicaMetrics_();
+    }
+    if(!UserStore::Init(userStore, userStorePath)) {
+        LOG_ERROR("========== User store init error!==========");
+        isClose_ = true;
+    }
+    UserCache::Instance()->SetIgnoreCase(UserStore::Instance()->IgnoreCase());
+    RegisterBatcher::Instance()->Init(REGISTER_BATCH_ROWS, REGISTER_BATCH_DELAY_MS);
+    StaticIndex::Instance()->Init(srcDir_);  //失败时静态文件退回逐个stat，不影响启动
+    if(ipFilterPath && *ipFilterPath) {
+        /* 规则文件有错时拒绝启动，免得以为生效了其实全部放行 */
+        if(!IpFilter::Instance()->Load(ipFilterPath)) {
+            LOG_ERROR("========== IP filter init error!==========");
+            isClose_ = true;
+        }
+        IpFilter::Instance()->Watch(ipFilterPath, IP_FILTER_CHECK_MS);
+    }
+    SessionStore::Instance()->Init(SESSION_MAX, SESSION_TTL_SEC);
+
 }
 
 WebServer::~WebServer() {
     close(listenFd_);
     isClose_ = true;
     free(srcDir_);
+    IpFilter::Instance()->Close();
+    StaticIndex::Instance()->Close();
+    RegisterBatcher::Instance()->Close();
+    SqlRouter::Instance()->Close();
     SqlConnPool::Instance()->ClosePool();
+    /* 主库和各副本的连接池共用客户端库，全部关闭后才能释放，且只释放一次 */
+    mysql_library_end();
+}
+
+/* 注册抓取时才计算的仪表盘指标 */
+void WebServer::InitMetrics_() {
+    Metrics* metrics = Metrics::Instance();
+    metrics->AddGauge("webserver_connections_active", "Currently open client connections.",
+                      [metrics] {
+                          return static_cast<double>(metrics->Sum(CONN_ACCEPTED)) - metrics->Sum(CONN_CLOSED);
+                      });
+    metrics->AddGauge("webserver_threadpool_queue_depth", "Tasks waiting in the thread pool queue.",
+                      [this] { return static_cast<double>(threadpool_->QueueSize()); });
+    metrics->AddGauge("webserver_dbpool_queue_depth", "Login/register requests waiting for a DB thread.",
+                      [this] { return static_cast<double>(dbpool_->QueueSize()); });
+    metrics->AddGauge("webserver_ip_filter_rules", "CIDR rules in the active accept filter.",
+                      [] { return static_cast<double>(IpFilter::Instance()->RuleCount()); });
+    metrics->AddGauge("webserver_static_index_files", "Files in the current static resource index.",
+                      [] { return static_cast<double>(StaticIndex::Instance()->Size()); });
+    metrics->AddGauge("webserver_buffer_bytes", "Memory held by connection read/write buffers.",
+                      [] { return static_cast<double>(Buffer::TotalBytes()); });
+    metrics->AddGauge("webserver_accept_paused", "1 while the listener is out of epoll because of overload.",
+                      [this] { return acceptPaused_ ? 1.0 : 0.0; });
+    metrics->AddGauge("webserver_threadpool_busy_threads", "Worker threads currently running a task.",
+                      [this] { return static_cast<double>(threadpool_->BusyCount()); });
+    metrics->AddGauge("webserver_dbpool_busy_threads", "DB threads currently running a task.",
+                      [this] { return static_cast<double>(dbpool_->BusyCount()); });
+    metrics->AddGauge("webserver_register_queue_depth", "Registrations waiting for the next write-behind batch.",
+                      [] { return static_cast<double>(RegisterBatcher::Instance()->QueueSize()); });
+    metrics->AddGauge("webserver_sessions_active", "Login sessions currently held in memory.",
+                      [] { return static_cast<double>(SessionStore::Instance()->Size()); });
+    metrics->AddGauge("webserver_sqlpool_free_connections", "Idle connections in SqlConnPool.",
+                      [] { return static_cast<double>(SqlConnPool::Instance()->GetFreeConnCount()); });
+    metrics->AddGauge("webserver_sqlpool_connections", "Open connections in SqlConnPool, idle or in use.",
+                      [] { return static_cast<double>(SqlConnPool::Instance()->GetConnCount()); });
+    metrics->AddGauge("webserver_sqlpool_utilization", "Fraction of the SqlConnPool maximum currently in use.",
+                      [] {
+                          SqlConnPool* pool = SqlConnPool::Instance();
+                          return pool->GetMaxConn() > 0 ?
+                              static_cast<double>(pool->GetUseCount()) / pool->GetMaxConn() : 0.0;
+                      });
+}
+
+/* 每个只读副本一组带backend标签的仪表盘，同名的连续注册 */
+void WebServer::InitReplicaMetrics_() {
+    Metrics* metrics = Metrics::Instance();
+    SqlRouter* router = SqlRouter::Instance();
+    int n = router->ReplicaCount();
+    for(int i = 0; i < n; i++) {
+        metrics->AddGauge("webserver_replica_latency_seconds", "Smoothed query latency per read replica.",
+                          [router, i] { return router->LatencyNs(i) / 1e9; }, router->Label(i));
+    }
+    for(int i = 0; i < n; i++) {
+        metrics->AddGauge("webserver_replica_inflight", "Queries in flight per read replica.",
+                          [router, i] { return static_cast<double>(router->Inflight(i)); }, router->Label(i));
+    }
+    for(int i = 0; i < n; i++) {
+        metrics->AddGauge("webserver_replica_up", "1 if the read replica is eligible for queries.",
+                          [router, i] { return router->IsUp(i) ? 1.0 : 0.0; }, router->Label(i));
+    }
 }
 
 void WebServer::InitEventMode_(int trigMode) {
@@ -73,10 +180,24 @@ void WebServer::InitEventMode_(int trigMode) {
 void WebServer::Start() {
     int timeMS = -1;  /* epoll wait timeout == -1 无事件将阻塞 */
     if(!isClose_) { LOG_INFO("========== Server start =========="); }
+    int dumpMS = LATENCY_DUMP_MS;
+    nextDump_ = Clock::now() + MS(dumpMS);
     while(!isClose_) {
+        IpFilter::Instance()->Quiescent();   //上一轮的查询都已结束，旧规则表可以释放
         if(timeoutMS_ > 0) {
             timeMS = timer_->GetNextTick();  //获取下一个定时器事件的发生事件，并返回该事件离当前时间的时间差。
         }
+        int dumpMS = DumpLatency_();
+        if(timeMS < 0 || timeMS > dumpMS) { timeMS = dumpMS; }
+        int dateMS = HttpHead::UpdateDate();  //响应头里的Date每秒渲染一次，工作线程直接拷贝
+        if(timeMS > dateMS) { timeMS = dateMS; }
+        if(acceptPaused_) {
+            /* 有新客户端在排队时先关掉空闲的长连接，不必等它们超时 */
+            if(!OverLimit_(RESUME_PERCENT) || (HasPendingAccept_() && EvictIdle_() > 0 && !OverLimit_(100))) {
+                ResumeAccept_();
+            }
+            else if(timeMS > ADMISSION_CHECK_MS) { timeMS = ADMISSION_CHECK_MS; }
+        }
         int eventCnt = epoller_->Wait(timeMS);
         for(int i = 0; i < eventCnt; i++) {
             /* 处理事件 */
@@ -103,19 +224,105 @@ void WebServer::Start() {
     }
 }
 
-void WebServer::SendError_(int fd, const char*info) {
-    assert(fd > 0);
-    int ret = send(fd, info, strlen(info), 0);
-    if(ret < 0) {
-        LOG_WARN("send error to client[%d] error!", fd);
+/* 到期则把各阶段延迟分位数和限流日志丢弃的条数写入日志，返回距下次输出的毫秒数 */
+int WebServer::DumpLatency_() {
+    TimeStamp now = Clock::now();
+    if(now >= nextDump_) {
+        Metrics::Instance()->DumpLatency();
+        LogLimiter::ReportAll();
+        /* MS()按const&取参，直接传类内初始化的静态常量要有类外定义，先拷到局部变量 */
+        int dumpMS = LATENCY_DUMP_MS;
+        nextDump_ = now + MS(dumpMS);
     }
+    return static_cast<int>(std::chrono::duration_cast<MS>(nextDump_ - now).count());
+}
+
+/* 直接RST：不在事件循环里阻塞发送，也不留TIME_WAIT */
+void WebServer::RejectConn_(int fd) {
+    assert(fd > 0);
+    struct linger optLinger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &optLinger, sizeof(optLinger));
     close(fd);
+    Metrics::Instance()->Inc(CONN_REJECTED);
+}
+
+/* 活跃连接数不设共享计数器：accept只在事件循环里累加accepted_，关闭可能发生在任何线程，
+   记在Metrics各线程的CONN_CLOSED槽位里。accepted_ - closedSeen_只会偏大，
+   达到limit时才汇总一次槽位修正，平时不碰其他线程的缓存行 */
+int WebServer::ActiveConn_(long long limit) {
+    long long active = static_cast<long long>(accepted_ - closedSeen_);
+    if(active >= limit) {
+        uint64_t closed = Metrics::Instance()->Sum(CONN_CLOSED);
+        if(closed > closedSeen_) { closedSeen_ = closed; }
+        active = static_cast<long long>(accepted_ - closedSeen_);
+    }
+    return static_cast<int>(active);
+}
+
+/* 任一资源达到上限的percent%即返回true */
+bool WebServer::OverLimit_(int percent) {
+    return ActiveConn_((static_cast<long long>(maxConn_) * percent + 99) / 100) * 100LL
+               >= static_cast<long long>(maxConn_) * percent
+        || Buffer::TotalBytes() * 100 >= maxBufferBytes_ * percent
+        || threadpool_->QueueSize() * 100 >= static_cast<size_t>(maxBacklog_) * percent;
+}
+
+/* 监听socket已移出epoll，直接查全连接队列里是否有等待accept的连接 */
+bool WebServer::HasPendingAccept_() {
+    struct pollfd pfd = { listenFd_, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* 按最后活跃时刻淘汰空闲最久的长连接，一次最多腾出(100 - RESUME_PERCENT)%的连接数。
+   全表扫描，只在超限时调用，并且间隔不小于ADMISSION_CHECK_MS */
+int WebServer::EvictIdle_() {
+    TimeStamp now = Clock::now();
+    if(now < nextEvict_) { return 0; }
+    int checkMS = ADMISSION_CHECK_MS;
+    nextEvict_ = now + MS(checkMS);
+    vector<HttpConn*> idle;
+    for(auto& user: users_) {
+        HttpConn* client = &user.second;
+        /* 有任务在途的连接归工作线程，这里关掉会和它的read/writev/ModFd抢同一个fd */
+        if(client->IsEvictable()) { idle.push_back(client); }
+    }
+    size_t n = max(1, maxConn_ * (100 - RESUME_PERCENT) / 100);
+    if(idle.size() > n) {
+        nth_element(idle.begin(), idle.begin() + n, idle.end(), [](HttpConn* a, HttpConn* b) {
+            return a->LastActiveMs() < b->LastActiveMs();
+        });
+        idle.resize(n);
+    }
+    for(HttpConn* client: idle) {
+        CloseConn_(client);
+    }
+    if(!idle.empty()) {
+        Metrics::Instance()->Add(IDLE_EVICTED, idle.size());
+        LOG_WARN_RL("Overload, evicted %zu idle connections", idle.size());
+    }
+    return static_cast<int>(idle.size());
+}
+
+void WebServer::PauseAccept_() {
+    if(acceptPaused_) { return; }
+    epoller_->DelFd(listenFd_);
+    acceptPaused_ = true;
+    Metrics::Instance()->Inc(ACCEPT_PAUSES);
+    LOG_WARN("Overload, pause accept. conn:%d buffer:%zuKB backlog:%zu",
+             ActiveConn_(0), Buffer::TotalBytes() >> 10, threadpool_->QueueSize());
+}
+
+void WebServer::ResumeAccept_() {
+    if(!acceptPaused_) { return; }
+    epoller_->AddFd(listenFd_, listenEvent_ | EPOLLIN);
+    acceptPaused_ = false;
+    LOG_INFO("Load dropped, resume accept. conn:%d", ActiveConn_(0));
 }
 
 
 void WebServer::CloseConn_(HttpConn* client) {
     assert(client);
-    LOG_INFO("Client[%d] quit!", client->GetFd());  
+    LOG_INFO_RL("Client[%d] quit!", client->GetFd());  
     epoller_->DelFd(client->GetFd()); //epoller类删除客户端的文件描述符，以停止对该客户端的事件更新
     client->Close();
 }
@@ -123,23 +330,41 @@ void WebServer::CloseConn_(HttpConn* client) {
 void WebServer::AddClient_(int fd, sockaddr_in addr) {
     assert(fd > 0);
     users_[fd].init(fd, addr);
+    accepted_++;
     if(timeoutMS_ > 0) {
-        timer_->add(fd, timeoutMS_, std::bind(&WebServer::CloseConn_, this, &users_[fd]));
+        /* 新连接等第一个请求也按长连接的空闲超时 */
+        timer_->add(fd, MsUntilCheck_(&users_[fd]), std::bind(&WebServer::OnTimer_, this, &users_[fd]));
     }
     epoller_->AddFd(fd, EPOLLIN | connEvent_);
     SetFdNonblock(fd);
-    LOG_INFO("Client[%d] in!", users_[fd].GetFd());
+    LOG_INFO_RL("Client[%d] in!", users_[fd].GetFd());
 }
 
 void WebServer::DealListen_() {
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
     do {
+        if(OverLimit_(100)) {
+            PauseAccept_();
+            return;
+        }
         int fd = accept(listenFd_, (struct sockaddr *)&addr, &len);
         if(fd <= 0) { return;}
-        else if(HttpConn::userCount >= MAX_FD) {
-            SendError_(fd, "Server busy!");
-            LOG_WARN("Clients is full!");
+        else if(!IpFilter::Instance()->Allow(addr.sin_addr.s_addr)) {
+            /* 还没有HttpConn状态，直接RST */
+            Metrics::Instance()->Inc(IP_FILTER_DENIED);
+            RejectConn_(fd);
+            continue;
+        }
+        else if(!RateLimiter::Instance()->Check(addr.sin_addr.s_addr)) {
+            /* 该IP已超限，连接建起来也只会收到429 */
+            Metrics::Instance()->Inc(RATE_LIMITED_CONN);
+            RejectConn_(fd);
+            continue;
+        }
+        else if(ActiveConn_(maxConn_) >= maxConn_) {
+            RejectConn_(fd);
+            LOG_WARN_RL("Clients is full!");
             return;
         }
         AddClient_(fd, addr);
@@ -149,22 +374,93 @@ void WebServer::DealListen_() {
 void WebServer::DealRead_(HttpConn* client) {
     assert(client);
     ExtentTime_(client);
-    threadpool_->AddTask(std::bind(&WebServer::OnRead_, this, client));
+    uint64_t now = MonoNs();
+    client->SetStartTime(now);
+    uint64_t gen = client->Generation();
+    client->BeginTask();
+    if(!threadpool_->TryAddTask(std::bind(&WebServer::OnRead_, this, client, gen, now),
+                                std::bind(&WebServer::OnReadShed_, this, client, gen), STATIC_QUEUE_MAX)) {
+        /* 还没读请求，回不了响应，只能断开 */
+        Metrics::Instance()->Inc(STATIC_TASKS_REJECTED);
+        LOG_WARN_RL("ThreadPool queue full, drop client[%d]", client->GetFd());
+        CloseConn_(client);
+    }
 }
 
 void WebServer::DealWrite_(HttpConn* client) {
     assert(client);
     ExtentTime_(client);
-    threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client));
+    /* 响应已经在写，不丢弃 */
+    client->BeginTask();
+    threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client, client->Generation(), MonoNs()));
 }
 
 void WebServer::ExtentTime_(HttpConn* client) {
     assert(client);
-    if(timeoutMS_ > 0) { timer_->adjust(client->GetFd(), timeoutMS_); }
+    if(timeoutMS_ > 0) { timer_->adjust(client->GetFd(), MsUntilCheck_(client)); }
+}
+
+/* 阶段状态由工作线程更新，事件循环里算出的截止时刻可能偏早，到期时再核对一次 */
+int WebServer::MsUntilDeadline_(HttpConn* client) {
+    uint64_t now = MonoNs() / 1000000;
+    uint64_t deadline = client->DeadlineMs(timeoutMS_, keepAliveMS_);
+    return deadline > now ? static_cast<int>(deadline - now) : 0;
 }
 
-void WebServer::OnRead_(HttpConn* client) {
+/* 工作线程写完响应后连接转为空闲，事件循环不知道；最迟keepAliveMS_后核对一次，
+   空闲超时才不会拖到处理请求的timeoutMS_ */
+int WebServer::MsUntilCheck_(HttpConn* client) {
+    int ms = MsUntilDeadline_(client);
+    return keepAliveMS_ > 0 ? min(ms, keepAliveMS_) : ms;
+}
+
+void WebServer::OnTimer_(HttpConn* client) {
+    assert(client);
+    if(client->IsClose()) { return; }   //已被读写出错或淘汰关闭
+    if(!client->IsCloseRequested()) {
+        if(MsUntilDeadline_(client) > 0) {
+            timer_->add(client->GetFd(), MsUntilCheck_(client), std::bind(&WebServer::OnTimer_, this, client));
+            return;
+        }
+        switch(client->Phase()) {
+        case HttpConn::PHASE_HEADER:
+            Metrics::Instance()->Inc(SLOW_HEADER_CLOSED);
+            break;
+        case HttpConn::PHASE_BODY:
+            Metrics::Instance()->Inc(SLOW_BODY_CLOSED);
+            break;
+        case HttpConn::PHASE_WRITE:
+            Metrics::Instance()->Inc(SLOW_DRAIN_CLOSED);
+            break;
+        default:
+            Metrics::Instance()->Inc(TIMER_EXPIRED);
+            break;
+        }
+        LOG_INFO_RL("Client[%d] timeout in phase %d", client->GetFd(), client->Phase());
+        client->RequestClose();
+    }
+    if(client->HasTask()) {
+        /* 连接归处理线程，这里关掉它还会ModFd/EndTask。由它在Rearm_里关闭；
+           标记晚于它的检查时，隔一会儿再来看 */
+        timer_->add(client->GetFd(), ADMISSION_CHECK_MS, std::bind(&WebServer::OnTimer_, this, client));
+        return;
+    }
+    CloseConn_(client);
+}
+
+/* 任务排队期间连接已被定时器关闭，或fd已分给新连接 */
+bool WebServer::DropStale_(HttpConn* client, uint64_t gen) {
+    if(client->IsStale(gen)) {
+        Metrics::Instance()->Inc(STALE_TASKS_DROPPED);
+        return true;
+    }
+    return false;
+}
+
+void WebServer::OnRead_(HttpConn* client, uint64_t gen, uint64_t queuedNs) {
     assert(client);
+    Metrics::Instance()->Record(STAGE_QUEUE, MonoNs() - queuedNs);
+    if(DropStale_(client, gen)) { return; }
     int ret = -1;
     int readErrno = 0;
     ret = client->read(&readErrno);
@@ -175,22 +471,101 @@ void WebServer::OnRead_(HttpConn* client) {
     OnProcess(client);
 }
 
+/* CoDel判定排队过久：仍要把请求读走，但不解析，直接回503 */
+void WebServer::OnReadShed_(HttpConn* client, uint64_t gen) {
+    assert(client);
+    if(DropStale_(client, gen)) { return; }
+    int readErrno = 0;
+    int ret = client->read(&readErrno);
+    if(ret <= 0 && readErrno != EAGAIN) {
+        CloseConn_(client);
+        return;
+    }
+    Metrics::Instance()->Inc(STATIC_TASKS_SHED);
+    client->Shed(503);
+    Rearm_(client, EPOLLOUT);
+}
+
 void WebServer::OnProcess(HttpConn* client) {
     if(client->process()) {
-        epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+        if(client->IsRegisterPending()) {
+            if(RegisterBatcher::Instance()->QueueSize() >= DB_QUEUE_MAX) {
+                RejectDb_(client);
+                return;
+            }
+            /* 注册进写后合并队列，批次提交后再注册写事件 */
+            client->Register(std::bind(&WebServer::OnVerified_, this, client, client->Generation()));
+            return;
+        }
+        if(client->IsVerifyPending()) {
+            /* 查库交给数据库线程，完成后再注册写事件 */
+            uint64_t gen = client->Generation();
+            if(!dbpool_->TryAddTask(std::bind(&WebServer::OnVerify_, this, client, gen, MonoNs()),
+                                    std::bind(&WebServer::OnVerifyShed_, this, client, gen), DB_QUEUE_MAX)) {
+                RejectDb_(client);
+            }
+            return;
+        }
+        Rearm_(client, EPOLLOUT);
     } else {
-        epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN);
+        Rearm_(client, EPOLLIN);
+    }
+}
+
+/* 查库排队已满，回503让客户端稍后重试 */
+void WebServer::RejectDb_(HttpConn* client) {
+    Metrics::Instance()->Inc(DB_TASKS_REJECTED);
+    LOG_WARN_RL("DB queue full, reject client[%d]", client->GetFd());
+    client->Reject(503);
+    Rearm_(client, EPOLLOUT);
+}
+
+void WebServer::OnVerify_(HttpConn* client, uint64_t gen, uint64_t queuedNs) {
+    assert(client);
+    Metrics::Instance()->Record(STAGE_DB_QUEUE, MonoNs() - queuedNs);
+    if(DropStale_(client, gen)) { return; } //等待查库期间连接已超时关闭
+    client->Verify();
+    OnVerified_(client, gen);
+}
+
+void WebServer::OnVerifyShed_(HttpConn* client, uint64_t gen) {
+    assert(client);
+    if(DropStale_(client, gen)) { return; }
+    Metrics::Instance()->Inc(DB_TASKS_SHED);
+    client->Reject(503);
+    OnVerified_(client, gen);
+}
+
+/* 查库可能阻塞数秒，交还前再核对一次代数 */
+void WebServer::OnVerified_(HttpConn* client, uint64_t gen) {
+    if(DropStale_(client, gen)) { return; }
+    Rearm_(client, EPOLLOUT);
+}
+
+/* 处理线程交还连接：EPOLLONESHOT下重新注册事件，之后不能再碰client。
+   定时器已标记关闭的在这里关，不再注册 */
+void WebServer::Rearm_(HttpConn* client, uint32_t events) {
+    if(client->IsCloseRequested()) {
+        CloseConn_(client);
+        return;
     }
+    epoller_->ModFd(client->GetFd(), connEvent_ | events);
+    client->EndTask();
 }
 
-void WebServer::OnWrite_(HttpConn* client) {
+void WebServer::OnWrite_(HttpConn* client, uint64_t gen, uint64_t queuedNs) {
     assert(client);
+    Metrics::Instance()->Record(STAGE_QUEUE, MonoNs() - queuedNs);
+    if(DropStale_(client, gen)) { return; }
     int ret = -1;
     int writeErrno = 0;
     ret = client->write(&writeErrno);
     if(client->ToWriteBytes() == 0) {
         /* 传输完成 */
+        Metrics::Instance()->Record(STAGE_TOTAL, MonoNs() - client->StartTime());
         if(client->IsKeepAlive()) {
+            /* 流水线上的下一个请求已在读缓冲区里，从这里开始计时；缓冲区空时DealRead_会重新设置 */
+            client->SetStartTime(MonoNs());
             OnProcess(client);
             return;
         }
@@ -198,7 +573,7 @@ void WebServer::OnWrite_(HttpConn* client) {
     else if(ret < 0) {
         if(writeErrno == EAGAIN) {
             /* 继续传输 */
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+            Rearm_(client, EPOLLOUT);
             return;
         }
     }
@@ -2,8 +2,10 @@
 #define WEBSERVER_H
 
 #include <unordered_map>
+#include <algorithm>     // nth_element
 #include <fcntl.h>       // fcntl()
 #include <unistd.h>      // close()
+#include <poll.h>        // poll()
 #include <assert.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -11,12 +13,18 @@
 #include <arpa/inet.h>
 
 #include "epoller.h"
+#include "ipfilter.h"
 #include "../log/log.h"
 #include "../timer/heaptimer.h"
 #include "../pool/sqlconnpool.h"
 #include "../pool/threadpool.h"
 #include "../pool/sqlconnRAII.h"
+#include "../pool/sqlrouter.h"
+#include "../pool/usercache.h"
 #include "../http/httpconn.h"
+#include "../metrics/metrics.h"
+#include "../store/userstore.h"
+#include "../store/registerbatcher.h"
 
 class WebServer {
 public:
@@ -24,7 +32,13 @@ public:
         int port, int trigMode, int timeoutMS, bool OptLinger, 
         int sqlPort, const char* sqlUser, const  char* sqlPwd, 
         const char* dbName, int connPoolNum, int threadNum,
-        bool openLog, int logLevel, int logQueSize);
+        bool openLog, int logLevel, int logQueSize,
+        int userStore = UserStore::MYSQL_STORE, const char* userStorePath = "./user.db",
+        const char* sqlReplicas = "",
+        int maxConn = 10000, int maxBufferMB = 256, int maxBacklog = 5000,
+        int rateLimit = 0, int rateBurst = 0,
+        const char* ipFilterPath = "",
+        int keepAliveMS = 15000, int keepAliveMax = 100);
 
     ~WebServer();
     void Start();
@@ -32,36 +46,85 @@ public:
 private:
     bool InitSocket_(); 
     void InitEventMode_(int trigMode);
+    void InitMetrics_();
+    void InitReplicaMetrics_();
     void AddClient_(int fd, sockaddr_in addr);
   
     void DealListen_();
     void DealWrite_(HttpConn* client);
     void DealRead_(HttpConn* client);
 
-    void SendError_(int fd, const char*info);
+    void RejectConn_(int fd);
+    int ActiveConn_(long long limit);
+    bool OverLimit_(int percent);
+    void PauseAccept_();
+    void ResumeAccept_();
     void ExtentTime_(HttpConn* client);
+    int MsUntilDeadline_(HttpConn* client);
+    int MsUntilCheck_(HttpConn* client);
+    bool HasPendingAccept_();
+    int EvictIdle_();
+    void OnTimer_(HttpConn* client);
     void CloseConn_(HttpConn* client);
 
-    void OnRead_(HttpConn* client);
-    void OnWrite_(HttpConn* client);
+    int DumpLatency_();
+
+    void OnRead_(HttpConn* client, uint64_t gen, uint64_t queuedNs);
+    void OnReadShed_(HttpConn* client, uint64_t gen);
+    void OnWrite_(HttpConn* client, uint64_t gen, uint64_t queuedNs);
     void OnProcess(HttpConn* client);
+    void OnVerify_(HttpConn* client, uint64_t gen, uint64_t queuedNs);
+    void OnVerifyShed_(HttpConn* client, uint64_t gen);
+    bool DropStale_(HttpConn* client, uint64_t gen);
+    void OnVerified_(HttpConn* client, uint64_t gen);
+    void Rearm_(HttpConn* client, uint32_t events);
+    void RejectDb_(HttpConn* client);
 
     static const int MAX_FD = 65536;
+    static const int LATENCY_DUMP_MS = 60000; //延迟分位数写日志的周期
+    static const int REGISTER_BATCH_ROWS = 64; //注册合并写入：最多凑这么多行
+    static const int REGISTER_BATCH_DELAY_MS = 5; //或第一条入队后最多等这么久
+    /* 按负载分两类线程池：静态资源的读写解析在threadpool_，登录注册的查库在dbpool_。
+       各自限制排队长度，查库慢时只让查库请求回503，不拖慢静态资源 */
+    static const int STATIC_QUEUE_MAX = 10000; //工作线程池排队上限，满了直接断开新的读事件
+    static const int DB_QUEUE_MAX = 1024;      //查库排队上限(数据库线程池+注册合并队列)，满了回503
+    /* CoDel：排队时间持续一个interval超过target就开始回503，工作线程的任务本该是微秒级的 */
+    static const int STATIC_CODEL_TARGET_MS = 5;
+    static const int STATIC_CODEL_INTERVAL_MS = 100;
+    static const int DB_CODEL_TARGET_MS = 50;
+    static const int DB_CODEL_INTERVAL_MS = 500;
+    /* 准入控制：连接数、缓冲区内存、工作线程排队任一达到上限(构造参数)就把监听socket移出epoll，
+       新连接留在内核的全连接队列里；全部回落到RESUME_PERCENT以下才恢复，避免来回抖动 */
+    static const int RESUME_PERCENT = 80;
+    static const int ADMISSION_CHECK_MS = 100;  //暂停期间检查能否恢复的周期，也是两次淘汰空闲连接的最小间隔
+    static const int IP_FILTER_CHECK_MS = 1000;  //检查CIDR规则文件是否修改的周期
+    static const int SESSION_MAX = 100000;     //会话上限，满了淘汰最早过期的
+    static const int SESSION_TTL_SEC = 1800;   //会话闲置这么久后过期，访问即续期
 
     static int SetFdNonblock(int fd);
 
     int port_;
     bool openLinger_;  //是否保持连接，即在客户端断开连接后是否继续等待客户端重新连接
     int timeoutMS_;  /* 毫秒MS */
+    int keepAliveMS_;  //长连接等下一个请求的超时，和处理请求的timeoutMS_分开
     bool isClose_;
+    int maxConn_;
+    size_t maxBufferBytes_;
+    int maxBacklog_;    //工作线程池排队任务数，不超过STATIC_QUEUE_MAX
+    bool acceptPaused_;
+    uint64_t accepted_;     //只在事件循环里累加，和closedSeen_同一起点
+    uint64_t closedSeen_;   //上次汇总时各线程记下的CONN_CLOSED之和
     int listenFd_; //监听套接字的文件描述符
     char* srcDir_; //源目录路径
     
     uint32_t listenEvent_; //监听事件类型，用于通知线程池处理监听事件   uint32_t是32位无符号整数
     uint32_t connEvent_; //连接事件类型，用于通知线程池处理连接事件 
+    TimeStamp nextDump_; //下次输出延迟统计的时刻
+    TimeStamp nextEvict_; //下次允许扫描淘汰空闲连接的时刻
    
     std::unique_ptr<HeapTimer> timer_;   //unique_ptr  c++11 智能指针类型 定时器对象，用于定时执行一些任务
     std::unique_ptr<ThreadPool> threadpool_; //线程池对象，用于吃了多个客户端连接的请求
+    std::unique_ptr<ThreadPool> dbpool_; //数据库线程，登录注册的查库在这里阻塞，不占用工作线程
     std::unique_ptr<Epoller> epoller_; //epoll对象，用于监控文件描述符的变化情况，以便及时处理新的连接和数据传输
     std::unordered_map<int, HttpConn> users_; //存储所有已建立连接的客户端对象，键为客户端的id，值为HTTPCONN对象 unordered_map 关联容器，存储键值对
 };
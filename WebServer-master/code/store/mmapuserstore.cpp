@@ -0,0 +1,223 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#include "mmapuserstore.h"
+#include <fcntl.h>       // open
+#include <unistd.h>      // close ftruncate
+#include <stdio.h>       // rename
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../log/log.h"
+
+using namespace std;
+
+const char MmapUserStore::MAGIC[8] = { 'W', 'S', 'U', 'S', 'E', 'R', '1', '\0' };
+
+MmapUserStore::MmapUserStore(): fd_(-1), base_(nullptr), mapLen_(0),
+    header_(nullptr), slots_(nullptr) {}
+
+MmapUserStore::~MmapUserStore() {
+    Close();
+}
+
+uint32_t MmapUserStore::Hash_(const string& name) {
+    /* FNV-1a，写进文件的值不能依赖std::hash的实现 */
+    uint32_t h = 2166136261u;
+    for(unsigned char c: name) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+size_t MmapUserStore::FileSize_(uint64_t capacity) {
+    return sizeof(Header_) + capacity * sizeof(Slot_);
+}
+
+MmapUserStore::Slot_* MmapUserStore::Probe_(Slot_* slots, uint64_t capacity,
+                                            const string& name, uint32_t hash) {
+    uint64_t mask = capacity - 1;
+    for(uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        Slot_* slot = &slots[i];
+        if(slot->hash == 0) {
+            return slot;
+        }
+        if(slot->hash == hash && slot->nameLen == name.size() &&
+           memcmp(slot->name, name.data(), name.size()) == 0) {
+            return slot;
+        }
+    }
+}
+
+bool MmapUserStore::Map_(const string& path, uint64_t capacity, bool create,
+                         int* fd, char** base, size_t* len) {
+    *fd = open(path.c_str(), O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0600);
+    if(*fd < 0) {
+        LOG_ERROR("UserStore open %s error: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    fstat(*fd, &st);
+    bool fresh = (st.st_size == 0);
+    if(fresh) {
+        if(ftruncate(*fd, FileSize_(capacity)) < 0) {
+            LOG_ERROR("UserStore ftruncate %s error: %s", path.c_str(), strerror(errno));
+            close(*fd);
+            return false;
+        }
+        *len = FileSize_(capacity);
+    } else {
+        *len = st.st_size;
+    }
+    if(*len < sizeof(Header_)) {
+        LOG_ERROR("UserStore %s is truncated", path.c_str());
+        close(*fd);
+        return false;
+    }
+    void* ret = mmap(nullptr, *len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if(ret == MAP_FAILED) {
+        LOG_ERROR("UserStore mmap %s error: %s", path.c_str(), strerror(errno));
+        close(*fd);
+        return false;
+    }
+    *base = static_cast<char*>(ret);
+    Header_* header = reinterpret_cast<Header_*>(*base);
+    if(fresh) {
+        memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        header->slotSize = sizeof(Slot_);
+        header->capacity = capacity;
+        header->count = 0;
+        return true;
+    }
+    uint64_t cap = header->capacity;
+    if(memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->slotSize != sizeof(Slot_) ||
+       cap == 0 || (cap & (cap - 1)) != 0 || *len != FileSize_(cap) || header->count >= cap) {
+        LOG_ERROR("UserStore %s is not a valid user table", path.c_str());
+        munmap(*base, *len);
+        close(*fd);
+        return false;
+    }
+    return true;
+}
+
+bool MmapUserStore::Open(const string& path) {
+    assert(!slots_);
+    if(!Map_(path, INIT_CAPACITY, false, &fd_, &base_, &mapLen_)) {
+        return false;
+    }
+    path_ = path;
+    header_ = reinterpret_cast<Header_*>(base_);
+    slots_ = reinterpret_cast<Slot_*>(base_ + sizeof(Header_));
+    LOG_INFO("UserStore %s: %llu users, capacity %llu", path.c_str(),
+             (unsigned long long)header_->count, (unsigned long long)header_->capacity);
+    return true;
+}
+
+void MmapUserStore::Close() {
+    unique_lock<shared_timed_mutex> locker(mtx_);
+    if(base_) {
+        msync(base_, mapLen_, MS_SYNC);
+        munmap(base_, mapLen_);
+        close(fd_);
+    }
+    fd_ = -1;
+    base_ = nullptr;
+    mapLen_ = 0;
+    header_ = nullptr;
+    slots_ = nullptr;
+}
+
+/* 持独占锁调用：新表写到临时文件，刷盘后rename，保证任何时刻文件都是一张完整的表 */
+bool MmapUserStore::Grow_() {
+    uint64_t capacity = header_->capacity * 2;
+    string tmpPath = path_ + ".tmp";
+    int fd;
+    char* base;
+    size_t len;
+    if(!Map_(tmpPath, capacity, true, &fd, &base, &len)) {
+        return false;
+    }
+    Header_* header = reinterpret_cast<Header_*>(base);
+    Slot_* slots = reinterpret_cast<Slot_*>(base + sizeof(Header_));
+    for(uint64_t i = 0; i < header_->capacity; i++) {
+        const Slot_& old = slots_[i];
+        if(old.hash == 0) { continue; }
+        *Probe_(slots, capacity, string(old.name, old.nameLen), old.hash) = old;
+    }
+    header->count = header_->count;
+    msync(base, len, MS_SYNC);
+    if(rename(tmpPath.c_str(), path_.c_str()) < 0) {
+        LOG_ERROR("UserStore rename %s error: %s", tmpPath.c_str(), strerror(errno));
+        munmap(base, len);
+        close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    munmap(base_, mapLen_);
+    close(fd_);
+    fd_ = fd;
+    base_ = base;
+    mapLen_ = len;
+    header_ = header;
+    slots_ = slots;
+    LOG_INFO("UserStore grown to capacity %llu", (unsigned long long)capacity);
+    return true;
+}
+
+UserStore::RESULT MmapUserStore::Login(const string& name, const string& pwd) {
+    if(name.size() > NAME_MAX_LEN) { return NOT_FOUND; }
+    shared_lock<shared_timed_mutex> locker(mtx_);
+    if(!slots_) { return FAILED; }
+    const Slot_* slot = Probe_(slots_, header_->capacity, name, Hash_(name));
+    if(slot->hash == 0) {
+        return NOT_FOUND;
+    }
+    if(slot->pwdLen != pwd.size() || memcmp(slot->pwd, pwd.data(), pwd.size()) != 0) {
+        return MISMATCH;
+    }
+    return OK;
+}
+
+UserStore::RESULT MmapUserStore::Register(const string& name, const string& pwd) {
+    if(name.size() > NAME_MAX_LEN || pwd.size() > PWD_MAX_LEN) {
+        LOG_WARN("UserStore: username or password too long");
+        return FAILED;
+    }
+    uint32_t hash = Hash_(name);
+    unique_lock<shared_timed_mutex> locker(mtx_);
+    if(!slots_) { return FAILED; }
+    Slot_* slot = Probe_(slots_, header_->capacity, name, hash);
+    if(slot->hash != 0) {
+        return EXISTS;
+    }
+    /* 装载因子超过0.7时扩容；扩容失败但仍有空槽(至少留一个保证探测能终止)时继续写 */
+    if((header_->count + 1) * 10 > header_->capacity * 7) {
+        if(Grow_()) {
+            slot = Probe_(slots_, header_->capacity, name, hash);
+        } else if(header_->count + 2 > header_->capacity) {
+            return FAILED;
+        }
+    }
+    slot->nameLen = name.size();
+    slot->pwdLen = pwd.size();
+    memcpy(slot->name, name.data(), name.size());
+    memcpy(slot->pwd, pwd.data(), pwd.size());
+    slot->hash = hash;
+    header_->count++;
+    return OK;
+}
+
+size_t MmapUserStore::Count() {
+    shared_lock<shared_timed_mutex> locker(mtx_);
+    return header_ ? header_->count : 0;
+}
+
+size_t MmapUserStore::Capacity() {
+    shared_lock<shared_timed_mutex> locker(mtx_);
+    return header_ ? header_->capacity : 0;
+}
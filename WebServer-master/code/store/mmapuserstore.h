@@ -0,0 +1,77 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#ifndef MMAPUSERSTORE_H
+#define MMAPUSERSTORE_H
+
+#include <string>
+#include <shared_mutex>
+#include <stdint.h>
+#include "userstore.h"
+
+/* 内嵌后端：文件整体mmap(MAP_SHARED)成一张开放寻址(线性探测)哈希表，写入即落到页缓存，
+   进程退出或崩溃不丢数据；装载因子超过0.7时倍增，新表写到临时文件后rename替换。
+   数据模型和user表一致，只支持查询和新增 */
+class MmapUserStore : public UserStore {
+public:
+    MmapUserStore();
+    ~MmapUserStore();
+
+    bool Open(const std::string& path);
+    void Close();
+
+    RESULT Login(const std::string& name, const std::string& pwd) override;
+    RESULT Register(const std::string& name, const std::string& pwd) override;
+    bool IsReady() override { return slots_ != nullptr; }
+    const char* Name() const override { return "mmap"; }
+
+    size_t Count();
+    size_t Capacity();
+
+    static const uint64_t INIT_CAPACITY = 1024;   // 槽位数，必须是2的幂
+
+private:
+    struct Header_ {
+        char magic[8];
+        uint32_t slotSize;
+        uint32_t reserved;
+        uint64_t capacity;
+        uint64_t count;
+        char pad[32];
+    };
+
+    /* 一个槽位128字节，不跨缓存行；hash为0表示空槽，写入时最后填hash */
+    struct Slot_ {
+        uint32_t hash;
+        uint8_t nameLen;
+        uint8_t pwdLen;
+        char name[NAME_MAX_LEN];
+        char pwd[PWD_MAX_LEN];
+        char pad[22];
+    };
+    static_assert(sizeof(Header_) == 64, "header layout is part of the file format");
+    static_assert(sizeof(Slot_) == 128, "slot layout is part of the file format");
+
+    static uint32_t Hash_(const std::string& name);
+    static size_t FileSize_(uint64_t capacity);
+    static Slot_* Probe_(Slot_* slots, uint64_t capacity, const std::string& name, uint32_t hash);
+
+    /* 打开并映射文件，文件为空时按capacity初始化 */
+    bool Map_(const std::string& path, uint64_t capacity, bool create, int* fd, char** base, size_t* len);
+    bool Grow_();
+
+    std::string path_;
+    int fd_;
+    char* base_;
+    size_t mapLen_;
+    Header_* header_;
+    Slot_* slots_;
+
+    std::shared_timed_mutex mtx_;   // 登录共享锁，注册和扩容独占
+
+    static const char MAGIC[8];
+};
+
+#endif //MMAPUSERSTORE_H
@@ -0,0 +1,271 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#include "mysqluserstore.h"
+#include <string.h>
+#include <ctype.h>
+#include <unordered_map>
+#include <mysql/errmsg.h>
+#include "../log/log.h"
+#include "../pool/sqlconnpool.h"
+#include "../pool/sqlconnRAII.h"
+#include "../pool/sqlrouter.h"
+
+using namespace std;
+
+/* 执行预编译语句；连接已断开时(mysql_ping会自动重连)重建语句再试一次。
+   事务中不能重试：重连后事务已回滚且autocommit恢复为开启 */
+static MYSQL_STMT* ExecuteStmt(SqlConnPool* pool, MYSQL* sql, const string& query,
+                               MYSQL_BIND* params, bool canRetry = true) {
+    for(int retry = 0; retry < (canRetry ? 2 : 1); retry++) {
+        MYSQL_STMT* stmt = pool->GetStmt(sql, query);
+        if(!stmt) { return nullptr; }
+        if(!mysql_stmt_bind_param(stmt, params) && !mysql_stmt_execute(stmt)) {
+            return stmt;
+        }
+        unsigned int err = mysql_stmt_errno(stmt);
+        LOG_WARN("MySql execute error: %s", mysql_stmt_error(stmt));
+        if(err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST) { break; }
+        pool->ResetStmts(sql);
+        if(mysql_ping(sql)) { break; }
+    }
+    return nullptr;
+}
+
+static void BindString(MYSQL_BIND& bind, const string& str, unsigned long* length) {
+    *length = str.size();
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = const_cast<char*>(str.data());
+    bind.buffer_length = str.size();
+    bind.length = length;
+}
+
+UserStore::RESULT MysqlUserStore::Select_(SqlConnPool* pool, MYSQL* sql, const string& name, string* pwd) {
+    /* 查询用户及密码：预编译语句+二进制协议绑定参数，不再拼接SQL */
+    unsigned long nameLen = 0;
+    MYSQL_BIND param[1];
+    memset(param, 0, sizeof(param));
+    BindString(param[0], name, &nameLen);
+    MYSQL_STMT* stmt = ExecuteStmt(pool, sql, "SELECT password FROM user WHERE username = ? LIMIT 1", param);
+    if(!stmt) { return FAILED; }
+
+    char password[64] = { 0 };
+    unsigned long passwordLen = 0;
+    MYSQL_BIND result[1];
+    memset(result, 0, sizeof(result));
+    result[0].buffer_type = MYSQL_TYPE_STRING;
+    result[0].buffer = password;
+    result[0].buffer_length = sizeof(password) - 1;
+    result[0].length = &passwordLen;
+
+    RESULT ret = FAILED;
+    if(!mysql_stmt_bind_result(stmt, result) && !mysql_stmt_store_result(stmt)) {
+        int fetched = mysql_stmt_fetch(stmt);
+        if(fetched == 0) {
+            pwd->assign(password, passwordLen);
+            ret = OK;
+        } else if(fetched == MYSQL_NO_DATA) {
+            ret = NOT_FOUND;
+        } else if(fetched == MYSQL_DATA_TRUNCATED) {
+            /* 库里的密码比允许的长度还长，不可能匹配 */
+            pwd->clear();
+            ret = MISMATCH;
+        }
+    }
+    mysql_stmt_free_result(stmt);
+    return ret;
+}
+
+UserStore::RESULT MysqlUserStore::SelectFrom_(int backend, const string& name, string* pwd) {
+    SqlRouter* router = SqlRouter::Instance();
+    SqlConnPool* pool = router->Pool(backend);
+    uint64_t start = MonoNs();
+    RESULT ret = FAILED;
+    {
+        MYSQL* sql;
+        SqlConnRAII sqlRAII(&sql, pool);
+        if(sql) {
+            ret = Select_(pool, sql, name, pwd);
+        } else {
+            LOG_WARN_RL("No MySql connection for UserVerify!");
+        }
+    }
+    router->Report(backend, MonoNs() - start, ret != FAILED);
+    return ret;
+}
+
+UserStore::RESULT MysqlUserStore::Login(const string& name, const string& pwd) {
+    /* 读副本，失败换下一个副本，最后回落主库 */
+    SqlRouter* router = SqlRouter::Instance();
+    string password;
+    RESULT ret = FAILED;
+    int backend = SqlRouter::PRIMARY;
+    for(int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+        backend = router->PickReader(backend);
+        ret = SelectFrom_(backend, name, &password);
+        if(ret != FAILED || backend == SqlRouter::PRIMARY) { break; }
+    }
+    if(ret == FAILED && backend != SqlRouter::PRIMARY) {
+        ret = SelectFrom_(SqlRouter::PRIMARY, name, &password);
+    }
+    /* 副本可能还没同步到刚注册的用户，查不到时以主库为准 */
+    if(ret == NOT_FOUND && backend != SqlRouter::PRIMARY) {
+        ret = SelectFrom_(SqlRouter::PRIMARY, name, &password);
+    }
+    if(ret == OK && password != pwd) {
+        ret = MISMATCH;
+    }
+    return ret;
+}
+
+UserStore::RESULT MysqlUserStore::Register(const string& name, const string& pwd) {
+    SqlConnPool* pool = SqlConnPool::Instance();
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql,  pool);
+    if(!sql) {
+        LOG_WARN("No MySql connection for UserVerify!");
+        return FAILED;
+    }
+    string password;
+    RESULT ret = Select_(pool, sql, name, &password);
+    if(ret == FAILED) { return FAILED; }
+    /* 注册行为 且 用户名未被使用*/
+    if(ret != NOT_FOUND) { return EXISTS; }
+
+    unsigned long nameLen = 0, pwdLen = 0;
+    MYSQL_BIND param[2];
+    memset(param, 0, sizeof(param));
+    BindString(param[0], name, &nameLen);
+    BindString(param[1], pwd, &pwdLen);
+    if(!ExecuteStmt(pool, sql, "INSERT INTO user(username, password) VALUES(?, ?)", param)) {
+        LOG_DEBUG( "Insert error!");
+        return FAILED;
+    }
+    return OK;
+}
+
+bool MysqlUserStore::IsReady() {
+    /* 主库未就绪时副本仍能处理登录 */
+    return SqlConnPool::Instance()->IsReady() || SqlRouter::Instance()->AnyReady();
+}
+
+static size_t RoundUpPow2(size_t n) {
+    size_t k = 1;
+    while(k < n) { k <<= 1; }
+    return k;
+}
+
+bool MysqlUserStore::SelectExisting_(MYSQL* sql, const vector<Account>& accounts,
+                                     const vector<size_t>& idx, vector<bool>* exists) {
+    size_t maxBatch = MAX_BATCH;
+    for(size_t begin = 0; begin < idx.size(); begin += maxBatch) {
+        size_t n = min(idx.size() - begin, maxBatch);
+        size_t k = RoundUpPow2(n);
+        /* 返回输入的序号而不是用户名，比较按user表的排序规则进行，和单条查询的语义一致 */
+        string query = "SELECT t.i FROM (";
+        for(size_t j = 0; j < k; j++) {
+            query += j ? " UNION ALL SELECT " : "SELECT ";
+            query += to_string(j) + (j ? ", ?" : " AS i, ? AS n");
+        }
+        query += ") AS t WHERE EXISTS (SELECT 1 FROM user WHERE user.username = t.n)";
+
+        vector<MYSQL_BIND> params(k);
+        vector<unsigned long> lengths(k);
+        memset(params.data(), 0, sizeof(MYSQL_BIND) * k);
+        for(size_t j = 0; j < k; j++) {
+            /* 不足k个时用最后一个补齐，补齐项的序号大于等于n，结果里忽略 */
+            BindString(params[j], accounts[idx[begin + min(j, n - 1)]].name, &lengths[j]);
+        }
+        MYSQL_STMT* stmt = ExecuteStmt(SqlConnPool::Instance(), sql, query, params.data());
+        if(!stmt) { return false; }
+
+        long long i = 0;
+        MYSQL_BIND result[1];
+        memset(result, 0, sizeof(result));
+        result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+        result[0].buffer = &i;
+        bool ok = !mysql_stmt_bind_result(stmt, result) && !mysql_stmt_store_result(stmt);
+        while(ok && mysql_stmt_fetch(stmt) == 0) {
+            if(i >= 0 && static_cast<size_t>(i) < n) {
+                (*exists)[idx[begin + i]] = true;
+            }
+        }
+        mysql_stmt_free_result(stmt);
+        if(!ok) { return false; }
+    }
+    return true;
+}
+
+bool MysqlUserStore::InsertBatch_(MYSQL* sql, const vector<Account>& accounts,
+                                  const vector<size_t>& idx) {
+    if(mysql_autocommit(sql, false)) { return false; }
+    bool ok = true;
+    size_t maxBatch = MAX_BATCH;
+    for(size_t begin = 0; ok && begin < idx.size(); ) {
+        /* 取不超过剩余行数的最大2的幂，语句种类有限，预编译语句可以复用 */
+        size_t k = 1;
+        while(k * 2 <= min(idx.size() - begin, maxBatch)) { k <<= 1; }
+        string query = "INSERT INTO user(username, password) VALUES";
+        for(size_t j = 0; j < k; j++) {
+            query += j ? ", (?, ?)" : "(?, ?)";
+        }
+        vector<MYSQL_BIND> params(2 * k);
+        vector<unsigned long> lengths(2 * k);
+        memset(params.data(), 0, sizeof(MYSQL_BIND) * 2 * k);
+        for(size_t j = 0; j < k; j++) {
+            const Account& account = accounts[idx[begin + j]];
+            BindString(params[2 * j], account.name, &lengths[2 * j]);
+            BindString(params[2 * j + 1], account.pwd, &lengths[2 * j + 1]);
+        }
+        ok = ExecuteStmt(SqlConnPool::Instance(), sql, query, params.data(), false) != nullptr;
+        begin += k;
+    }
+    if(ok) {
+        ok = !mysql_commit(sql);
+    }
+    if(!ok) {
+        LOG_WARN("MySql batch insert error: %s", mysql_error(sql));
+        mysql_rollback(sql);
+    }
+    mysql_autocommit(sql, true);
+    return ok;
+}
+
+void MysqlUserStore::RegisterBatch(const vector<Account>& accounts, vector<RESULT>* results) {
+    results->assign(accounts.size(), FAILED);
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql,  SqlConnPool::Instance());
+    if(!sql) {
+        LOG_WARN("No MySql connection for UserVerify!");
+        return;
+    }
+    /* 批内查重：按ASCII小写比较(见IgnoreCase)，重名的只保留第一个 */
+    unordered_map<string, size_t> seen;
+    vector<size_t> candidates;
+    for(size_t i = 0; i < accounts.size(); i++) {
+        string key = accounts[i].name;
+        for(char& c: key) { c = tolower(static_cast<unsigned char>(c)); }
+        if(seen.emplace(key, i).second) {
+            candidates.push_back(i);
+        } else {
+            (*results)[i] = EXISTS;
+        }
+    }
+    vector<bool> exists(accounts.size(), false);
+    if(!SelectExisting_(sql, accounts, candidates, &exists)) { return; }
+
+    vector<size_t> inserts;
+    for(size_t i: candidates) {
+        if(exists[i]) {
+            (*results)[i] = EXISTS;
+        } else {
+            inserts.push_back(i);
+        }
+    }
+    if(inserts.empty() || !InsertBatch_(sql, accounts, inserts)) { return; }
+    for(size_t i: inserts) {
+        (*results)[i] = OK;
+    }
+}
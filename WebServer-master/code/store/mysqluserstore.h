@@ -0,0 +1,41 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#ifndef MYSQLUSERSTORE_H
+#define MYSQLUSERSTORE_H
+
+#include <mysql/mysql.h>
+#include "userstore.h"
+
+class SqlConnPool;
+
+/* MySQL后端：连接取自SqlConnPool，预编译语句缓存在连接上。
+   登录查询经SqlRouter分到只读副本，注册的查重和写入都在主库 */
+class MysqlUserStore : public UserStore {
+public:
+    RESULT Login(const std::string& name, const std::string& pwd) override;
+    RESULT Register(const std::string& name, const std::string& pwd) override;
+    void RegisterBatch(const std::vector<Account>& accounts, std::vector<RESULT>* results) override;
+    bool IsReady() override;
+    const char* Name() const override { return "mysql"; }
+    bool IgnoreCase() const override { return true; }    // user表默认排序规则不区分大小写
+
+private:
+    /* 查用户密码，找到时写入pwd */
+    static RESULT Select_(SqlConnPool* pool, MYSQL* sql, const std::string& name, std::string* pwd);
+    /* 在指定后端(SqlRouter::PRIMARY为主库)上查询，并上报延迟和成败 */
+    static RESULT SelectFrom_(int backend, const std::string& name, std::string* pwd);
+    /* 查出idx中已存在的用户名，一条IN查询，参数个数补齐到2的幂以复用预编译语句 */
+    static bool SelectExisting_(MYSQL* sql, const std::vector<Account>& accounts,
+                                const std::vector<size_t>& idx, std::vector<bool>* exists);
+    /* 在一个事务中写入，按2的幂拆成若干条多行INSERT，只提交一次 */
+    static bool InsertBatch_(MYSQL* sql, const std::vector<Account>& accounts,
+                             const std::vector<size_t>& idx);
+
+    static const size_t MAX_BATCH = 64;     // 单条语句的最大行数
+    static const int MAX_READ_ATTEMPTS = 2; // 登录最多试几个副本，之后回落主库
+};
+
+#endif //MYSQLUSERSTORE_H
@@ -0,0 +1,93 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-12
+ * @copyleft Apache 2.0
+ */
+#include "registerbatcher.h"
+#include <assert.h>
+#include "../metrics/metrics.h"
+
+using namespace std;
+
+RegisterBatcher::RegisterBatcher(): maxRows_(0), maxDelayMs_(0), isClose_(false) {}
+
+RegisterBatcher::~RegisterBatcher() {
+    Close();
+}
+
+RegisterBatcher* RegisterBatcher::Instance() {
+    static RegisterBatcher batcher;
+    return &batcher;
+}
+
+void RegisterBatcher::Init(int maxRows, int maxDelayMs) {
+    assert(maxRows > 0 && maxDelayMs >= 0);
+    assert(!thread_.joinable());
+    maxRows_ = maxRows;
+    maxDelayMs_ = maxDelayMs;
+    isClose_ = false;
+    thread_ = thread(&RegisterBatcher::Loop_, this);
+}
+
+void RegisterBatcher::Close() {
+    {
+        lock_guard<mutex> locker(mtx_);
+        isClose_ = true;
+    }
+    cond_.notify_all();
+    if(thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void RegisterBatcher::Submit(const string& name, const string& pwd, Callback cb) {
+    unique_lock<mutex> locker(mtx_);
+    if(!thread_.joinable() || isClose_) {
+        locker.unlock();
+        cb(UserStore::Instance()->Register(name, pwd));
+        return;
+    }
+    queue_.push_back({ { name, pwd }, std::move(cb), Clock_::now() });
+    /* 只在开始计时和凑满一批时唤醒，其余时候后台线程自己按时间醒来 */
+    if(queue_.size() == 1 || queue_.size() == static_cast<size_t>(maxRows_)) {
+        cond_.notify_one();
+    }
+}
+
+size_t RegisterBatcher::QueueSize() {
+    lock_guard<mutex> locker(mtx_);
+    return queue_.size();
+}
+
+void RegisterBatcher::Loop_() {
+    vector<UserStore::Account> accounts;
+    vector<Callback> callbacks;
+    vector<UserStore::RESULT> results;
+    unique_lock<mutex> locker(mtx_);
+    while(true) {
+        cond_.wait(locker, [this] { return isClose_ || !queue_.empty(); });
+        if(queue_.empty()) { break; }   // 已关闭且处理完
+        Clock_::time_point deadline = queue_.front().enqueued + chrono::milliseconds(maxDelayMs_);
+        cond_.wait_until(locker, deadline, [this] {
+            return isClose_ || queue_.size() >= static_cast<size_t>(maxRows_);
+        });
+
+        size_t n = min(queue_.size(), static_cast<size_t>(maxRows_));
+        accounts.clear();
+        callbacks.clear();
+        for(size_t i = 0; i < n; i++) {
+            accounts.push_back(std::move(queue_.front().account));
+            callbacks.push_back(std::move(queue_.front().cb));
+            queue_.pop_front();
+        }
+        locker.unlock();
+
+        UserStore::Instance()->RegisterBatch(accounts, &results);
+        Metrics::Instance()->Inc(REGISTER_BATCHES);
+        Metrics::Instance()->Add(REGISTER_ROWS, n);
+        for(size_t i = 0; i < n; i++) {
+            callbacks[i](results[i]);
+        }
+        locker.lock();
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-12
+ * @copyleft Apache 2.0
+ */
+#ifndef REGISTERBATCHER_H
+#define REGISTERBATCHER_H
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "userstore.h"
+
+/* 注册写后合并：请求入队即返回，后台线程在第一条到达后最多等maxDelayMs或凑满maxRows，
+   整批交给UserStore::RegisterBatch(一次查重+一个事务提交)，提交后逐个回调确认 */
+class RegisterBatcher {
+public:
+    typedef std::function<void(UserStore::RESULT)> Callback;
+
+    static RegisterBatcher* Instance();
+
+    void Init(int maxRows = 64, int maxDelayMs = 5);
+    void Close();   // 处理完已入队的注册后退出
+
+    /* 回调在后台线程中执行；未Init时同步执行并在当前线程回调 */
+    void Submit(const std::string& name, const std::string& pwd, Callback cb);
+
+    size_t QueueSize();
+
+private:
+    RegisterBatcher();
+    ~RegisterBatcher();
+
+    typedef std::chrono::steady_clock Clock_;
+
+    struct Pending_ {
+        UserStore::Account account;
+        Callback cb;
+        Clock_::time_point enqueued;
+    };
+
+    void Loop_();
+
+    int maxRows_;
+    int maxDelayMs_;
+    bool isClose_;
+    std::deque<Pending_> queue_;
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::thread thread_;
+};
+
+#endif //REGISTERBATCHER_H
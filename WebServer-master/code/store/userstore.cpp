@@ -0,0 +1,48 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#include "userstore.h"
+#include "mysqluserstore.h"
+#include "mmapuserstore.h"
+#include "../log/log.h"
+
+using namespace std;
+
+unique_ptr<UserStore>& UserStore::Holder_() {
+    static unique_ptr<UserStore> store(new MysqlUserStore());
+    return store;
+}
+
+void UserStore::RegisterBatch(const vector<Account>& accounts, vector<RESULT>* results) {
+    results->resize(accounts.size());
+    for(size_t i = 0; i < accounts.size(); i++) {
+        (*results)[i] = Register(accounts[i].name, accounts[i].pwd);
+    }
+}
+
+UserStore* UserStore::Instance() {
+    return Holder_().get();
+}
+
+bool UserStore::Init(int type, const string& path) {
+    switch(type) {
+    case MYSQL_STORE:
+        Holder_().reset(new MysqlUserStore());
+        break;
+    case MMAP_STORE: {
+        unique_ptr<MmapUserStore> store(new MmapUserStore());
+        if(!store->Open(path)) {
+            return false;
+        }
+        Holder_().reset(store.release());
+        break;
+    }
+    default:
+        LOG_ERROR("Unknown user store type: %d", type);
+        return false;
+    }
+    LOG_INFO("User store: %s", Instance()->Name());
+    return true;
+}
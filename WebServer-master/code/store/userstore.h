@@ -0,0 +1,61 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-10
+ * @copyleft Apache 2.0
+ */
+#ifndef USERSTORE_H
+#define USERSTORE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+
+/* 用户存储接口：登录校验和注册。后端在启动时选定，之后只读，
+   实现必须可以被多个数据库线程并发调用 */
+class UserStore {
+public:
+    enum TYPE {
+        MYSQL_STORE = 0,    // SqlConnPool连接的MySQL user表
+        MMAP_STORE,         // 内嵌的mmap哈希表，持久化到本地文件，不依赖数据库服务
+    };
+
+    enum RESULT {
+        OK = 0,
+        MISMATCH,       // 用户存在，密码不对
+        NOT_FOUND,
+        EXISTS,         // 注册时用户名已被使用
+        FAILED,         // 存储不可用或出错
+    };
+
+    struct Account {
+        std::string name;
+        std::string pwd;
+    };
+
+    virtual ~UserStore() = default;
+
+    virtual RESULT Login(const std::string& name, const std::string& pwd) = 0;
+    virtual RESULT Register(const std::string& name, const std::string& pwd) = 0;
+
+    /* 批量注册，results与accounts一一对应；批内重名的只有第一个可能成功。
+       默认逐个Register，能合并写入的后端应覆盖 */
+    virtual void RegisterBatch(const std::vector<Account>& accounts, std::vector<RESULT>* results);
+
+    /* 能否处理请求，未就绪时查库的请求直接回503 */
+    virtual bool IsReady() = 0;
+    virtual const char* Name() const = 0;
+    /* 用户名是否不区分大小写(按ASCII)，UserCache按同样的规则归并缓存键 */
+    virtual bool IgnoreCase() const { return false; }
+
+    /* 启动时调用一次；path为MMAP_STORE的数据文件。失败返回false，保留原后端 */
+    static bool Init(int type, const std::string& path);
+    static UserStore* Instance();   // 未Init时为MySQL后端
+
+    static const size_t NAME_MAX_LEN = 50;  // 与user表username/password char(50)一致
+    static const size_t PWD_MAX_LEN = 50;
+
+private:
+    static std::unique_ptr<UserStore>& Holder_();
+};
+
+#endif //USERSTORE_H
@@ -7,12 +7,12 @@
 
 void HeapTimer::siftup_(size_t i) {
     assert(i >= 0 && i < heap_.size());
-    size_t j = (i - 1) / 2;
-    while(j >= 0) {
+    /* size_t无符号，i为0时(i - 1) / 2会回绕，必须先判断是否已到堆顶 */
+    while(i > 0) {
+        size_t j = (i - 1) / 2;
         if(heap_[j] < heap_[i]) { break; }
         SwapNode_(i, j);
         i = j;
-        j = (i - 1) / 2;
     }
 }
 
@@ -92,8 +92,12 @@ void HeapTimer::del_(size_t index) {
 void HeapTimer::adjust(int id, int timeout) {
     /* 调整指定id的结点 */
     assert(!heap_.empty() && ref_.count(id) > 0);
-    heap_[ref_[id]].expires = Clock::now() + MS(timeout);;
-    siftdown_(ref_[id], heap_.size());
+    size_t i = ref_[id];
+    heap_[i].expires = Clock::now() + MS(timeout);
+    /* 截止时刻可能提前也可能推后 */
+    if(!siftdown_(i, heap_.size())) {
+        siftup_(i);
+    }
 }
 
 void HeapTimer::tick() {
@@ -106,8 +110,9 @@ void HeapTimer::tick() {
         if(std::chrono::duration_cast<MS>(node.expires - Clock::now()).count() > 0) { 
             break; 
         }
-        node.cb();
+        /* 先出堆再回调，回调里可以为同一个id重新add */
         pop();
+        node.cb();
     }
 }
 
@@ -15,6 +15,7 @@
 #include <assert.h> 
 #include <chrono>
 #include "../log/log.h"
+#include "../metrics/metrics.h"
 
 typedef std::function<void()> TimeoutCallBack;
 typedef std::chrono::high_resolution_clock Clock;
@@ -0,0 +1,518 @@
+/*
+ * @Author       : mark
+ * @Date         : 2020-07-05
+ * @copyleft Apache 2.0
+ */
+/* 基于epoll的HTTP/1.1压测工具：少量线程驱动大量keep-alive/流水线连接，
+   支持闭环(每个连接收到响应再发下一个)与恒定速率开环两种模式。
+   开环模式下延迟从"计划发送时刻"开始计算，修正协调遗漏(coordinated omission)。 */
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "../code/metrics/histogram.h"
+
+struct Config {
+    std::string host = "127.0.0.1";
+    int port = 1316;
+    int threads = 2;
+    int conns = 100;
+    int duration = 10;          // 秒
+    double rate = 0;            // 总请求速率，0为闭环模式
+    int pipeline = 1;           // 每个连接最多同时在途的请求数
+    bool keepAlive = true;
+    std::vector<std::string> requests;   // 预先拼好的请求报文
+    std::vector<double> weights;         // 累积权重，与requests一一对应
+};
+
+struct Conn {
+    int fd = -1;
+    bool connecting = false;
+    bool closeAfter = false;    // 服务端声明Connection: close
+    uint64_t retryAt = 0;
+    std::string out;
+    size_t outPos = 0;
+    std::string in;
+    size_t inPos = 0;
+    std::deque<uint64_t> intended;  // 在途请求的计划发送时刻
+    std::deque<uint64_t> sent;      // 在途请求的实际发送时刻
+};
+
+struct Stats {
+    uint64_t completed = 0;
+    uint64_t non2xx = 0;
+    uint64_t connectErrors = 0;
+    uint64_t ioErrors = 0;
+    uint64_t reconnects = 0;
+    uint64_t bytesIn = 0;
+    Histogram latency;          // 计划发送时刻 -> 响应完成
+    Histogram service;          // 实际发送时刻 -> 响应完成
+};
+
+class Worker {
+public:
+    Worker(const Config& cfg, int conns, double rate, unsigned seed)
+        : cfg_(cfg), conns_(conns), rate_(rate), rng_(seed) {}
+
+    void Run(uint64_t endNs);
+    Stats& GetStats() { return stats_; }
+
+private:
+    void Open_(Conn& c, uint64_t now);
+    void Close_(Conn& c, bool error, uint64_t now);
+    void Issue_(Conn& c, uint64_t intended, uint64_t now);
+    void Flush_(Conn& c, uint64_t now);
+    void Read_(Conn& c, uint64_t now);
+    bool Parse_(Conn& c, uint64_t now);
+    void Refill_(Conn& c, uint64_t now);
+    bool HasRoom_(const Conn& c) const {
+        return c.fd >= 0 && !c.connecting && !c.closeAfter
+               && static_cast<int>(c.intended.size()) < cfg_.pipeline;
+    }
+    const std::string& PickRequest_();
+
+    const Config& cfg_;
+    std::vector<Conn> conns_;
+    double rate_;
+    std::mt19937 rng_;
+    int epfd_ = -1;
+    std::deque<uint64_t> backlog_;  // 开环模式下没有空闲连接时排队的计划时刻
+    size_t cursor_ = 0;
+    Stats stats_;
+};
+
+static sockaddr_in g_addr;
+
+static uint64_t NowNs() { return MonoNs(); }
+
+const std::string& Worker::PickRequest_() {
+    if(cfg_.requests.size() == 1) { return cfg_.requests[0]; }
+    std::uniform_real_distribution<double> dist(0, cfg_.weights.back());
+    double r = dist(rng_);
+    size_t i = std::lower_bound(cfg_.weights.begin(), cfg_.weights.end(), r) - cfg_.weights.begin();
+    return cfg_.requests[std::min(i, cfg_.requests.size() - 1)];
+}
+
+void Worker::Open_(Conn& c, uint64_t now) {
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c.fd < 0) {
+        stats_.connectErrors++;
+        c.retryAt = now + 100000000ULL;
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.out.clear(); c.outPos = 0;
+    c.in.clear(); c.inPos = 0;
+    c.closeAfter = false;
+    int ret = connect(c.fd, (sockaddr*)&g_addr, sizeof(g_addr));
+    if(ret < 0 && errno != EINPROGRESS) {
+        close(c.fd);
+        c.fd = -1;
+        stats_.connectErrors++;
+        c.retryAt = now + 100000000ULL;
+        return;
+    }
+    c.connecting = true;
+    epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = &c;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+void Worker::Close_(Conn& c, bool error, uint64_t now) {
+    if(c.fd >= 0) {
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+    if(error) {
+        stats_.ioErrors += c.intended.empty() ? 1 : c.intended.size();
+    } else if(!c.intended.empty()) {
+        /* 未完成的请求放回队首，换一个连接重新发送，计划时刻不变 */
+        if(rate_ > 0) {
+            backlog_.insert(backlog_.begin(), c.intended.begin(), c.intended.end());
+        }
+    }
+    c.intended.clear();
+    c.sent.clear();
+    c.connecting = false;
+    stats_.reconnects++;
+    c.retryAt = error ? now + 10000000ULL : now;
+}
+
+void Worker::Issue_(Conn& c, uint64_t intended, uint64_t now) {
+    c.out.append(PickRequest_());
+    c.intended.push_back(intended);
+    c.sent.push_back(now);
+}
+
+void Worker::Flush_(Conn& c, uint64_t now) {
+    while(c.outPos < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN) { break; }
+            Close_(c, true, now);
+            return;
+        }
+        c.outPos += n;
+    }
+    if(c.outPos == c.out.size()) {
+        c.out.clear();
+        c.outPos = 0;
+    }
+    epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | (c.out.empty() ? 0 : EPOLLOUT);
+    ev.data.ptr = &c;
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+/* 闭环：把流水线补满；开环：优先发送积压的计划请求 */
+void Worker::Refill_(Conn& c, uint64_t now) {
+    bool issued = false;
+    while(HasRoom_(c)) {
+        if(rate_ > 0) {
+            if(backlog_.empty()) { break; }
+            Issue_(c, backlog_.front(), now);
+            backlog_.pop_front();
+        } else {
+            Issue_(c, now, now);
+        }
+        issued = true;
+        if(!cfg_.keepAlive) { break; }
+    }
+    if(issued) { Flush_(c, now); }
+}
+
+static size_t FindHeader(const std::string& head, const char* name) {
+    /* 大小写不敏感地查找"\r\nname:" */
+    size_t len = strlen(name);
+    for(size_t pos = head.find("\r\n"); pos != std::string::npos; pos = head.find("\r\n", pos + 2)) {
+        if(head.size() >= pos + 2 + len && strncasecmp(head.data() + pos + 2, name, len) == 0) {
+            return pos + 2 + len;
+        }
+    }
+    return std::string::npos;
+}
+
+bool Worker::Parse_(Conn& c, uint64_t now) {
+    while(!c.intended.empty()) {
+        size_t end = c.in.find("\r\n\r\n", c.inPos);
+        if(end == std::string::npos) { break; }
+        std::string head = c.in.substr(c.inPos, end + 2 - c.inPos);
+        if(head.compare(0, 5, "HTTP/") != 0 || head.size() < 12) {
+            Close_(c, true, now);
+            return false;
+        }
+        int status = atoi(head.c_str() + 9);
+        size_t bodyLen = 0;
+        size_t p = FindHeader(head, "content-length:");
+        if(p != std::string::npos) { bodyLen = strtoul(head.c_str() + p, nullptr, 10); }
+        p = FindHeader(head, "connection:");
+        if(p != std::string::npos) {
+            while(head[p] == ' ') { p++; }
+            if(strncasecmp(head.c_str() + p, "close", 5) == 0) { c.closeAfter = true; }
+        }
+        size_t total = end + 4 + bodyLen;
+        if(c.in.size() < total) { break; }
+
+        stats_.completed++;
+        stats_.bytesIn += total - c.inPos;
+        if(status < 200 || status >= 300) { stats_.non2xx++; }
+        stats_.latency.Record(now - c.intended.front());
+        stats_.service.Record(now - c.sent.front());
+        c.intended.pop_front();
+        c.sent.pop_front();
+        c.inPos = total;
+    }
+    if(c.inPos == c.in.size()) {
+        c.in.clear();
+        c.inPos = 0;
+    } else if(c.inPos > 65536) {
+        c.in.erase(0, c.inPos);
+        c.inPos = 0;
+    }
+    return true;
+}
+
+void Worker::Read_(Conn& c, uint64_t now) {
+    char buf[65536];
+    while(true) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if(n > 0) {
+            c.in.append(buf, n);
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN) { break; }
+        /* 对端关闭：已经收完的响应照常统计 */
+        if(!Parse_(c, now)) { return; }
+        Close_(c, n < 0 || !c.intended.empty(), now);
+        return;
+    }
+    if(!Parse_(c, now)) { return; }
+    if(c.closeAfter && c.intended.empty()) {
+        Close_(c, false, now);
+        return;
+    }
+    Refill_(c, now);
+}
+
+void Worker::Run(uint64_t endNs) {
+    epfd_ = epoll_create1(0);
+    uint64_t now = NowNs();
+    for(auto& c: conns_) { Open_(c, now); }
+
+    const uint64_t interval = rate_ > 0 ? static_cast<uint64_t>(1e9 / rate_) : 0;
+    uint64_t nextIntended = now;
+    std::vector<epoll_event> events(1024);
+
+    while((now = NowNs()) < endNs) {
+        /* 断开的连接到时间后重连 */
+        for(auto& c: conns_) {
+            if(c.fd < 0 && c.retryAt <= now) { Open_(c, now); }
+        }
+        if(interval) {
+            /* 开环：按计划时刻生成请求，找不到空闲连接就排队，延迟照样从计划时刻算 */
+            while(nextIntended <= now) {
+                backlog_.push_back(nextIntended);
+                nextIntended += interval;
+            }
+            for(size_t n = 0; n < conns_.size() && !backlog_.empty(); n++) {
+                Conn& c = conns_[cursor_++ % conns_.size()];
+                if(HasRoom_(c)) { Refill_(c, now); }
+            }
+        }
+        int timeoutMs = 100;
+        if(interval) {
+            uint64_t wait = nextIntended > now ? nextIntended - now : 0;
+            timeoutMs = static_cast<int>(std::min<uint64_t>(wait / 1000000, 100));
+        }
+        int n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), timeoutMs);
+        now = NowNs();
+        for(int i = 0; i < n; i++) {
+            Conn& c = *static_cast<Conn*>(events[i].data.ptr);
+            if(c.fd < 0) { continue; }
+            uint32_t ev = events[i].events;
+            if(c.connecting) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err || (ev & (EPOLLERR | EPOLLHUP))) {
+                    epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+                    close(c.fd);
+                    c.fd = -1;
+                    c.connecting = false;
+                    stats_.connectErrors++;
+                    c.retryAt = now + 100000000ULL;
+                    continue;
+                }
+                c.connecting = false;
+                Flush_(c, now);
+                if(c.fd >= 0) { Refill_(c, now); }
+                continue;
+            }
+            if(ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                Read_(c, now);
+            }
+            if(c.fd >= 0 && (ev & EPOLLOUT)) {
+                Flush_(c, now);
+            }
+        }
+    }
+    for(auto& c: conns_) {
+        if(c.fd >= 0) { close(c.fd); }
+    }
+    close(epfd_);
+}
+
+static void Usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] http://host:port/path\n"
+        "  -t, --threads N      worker threads (default 2)\n"
+        "  -c, --connections N  total connections (default 100)\n"
+        "  -d, --duration S     test duration in seconds (default 10)\n"
+        "  -R, --rate N         open-loop mode at N req/s in total (default: closed loop)\n"
+        "  -p, --pipeline N     max in-flight requests per connection (default 1)\n"
+        "  -K, --no-keepalive   send Connection: close and reconnect per request\n"
+        "  -u, --urls FILE      URL mix, one \"[weight] path\" per line\n", prog);
+}
+
+static std::string BuildRequest(const Config& cfg, const std::string& path) {
+    std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + cfg.host + ":" + std::to_string(cfg.port) + "\r\n";
+    req += cfg.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    req += "User-Agent: loadgen\r\n\r\n";
+    return req;
+}
+
+static bool LoadUrls(Config& cfg, const char* file) {
+    std::ifstream in(file);
+    if(!in) { return false; }
+    std::string line;
+    double total = 0;
+    while(std::getline(in, line)) {
+        std::istringstream ss(line);
+        std::string first, path;
+        if(!(ss >> first) || first[0] == '#') { continue; }
+        double weight = 1;
+        if(first[0] == '/') {
+            path = first;
+        } else {
+            weight = atof(first.c_str());
+            if(!(ss >> path) || weight <= 0) { continue; }
+        }
+        total += weight;
+        cfg.requests.push_back(BuildRequest(cfg, path));
+        cfg.weights.push_back(total);
+    }
+    return !cfg.requests.empty();
+}
+
+static void PrintHistogram(const char* title, const Histogram& h) {
+    const double ps[] = { 50, 90, 99, 99.9, 99.99 };
+    uint64_t v[5];
+    h.Percentiles(ps, 5, v);
+    double mean = h.Count() ? static_cast<double>(h.Sum()) / h.Count() : 0;
+    printf("%s\n", title);
+    printf("    mean %9.3fms  p50 %9.3fms  p90 %9.3fms  p99 %9.3fms\n",
+           mean / 1e6, v[0] / 1e6, v[1] / 1e6, v[2] / 1e6);
+    printf("   p99.9 %9.3fms p99.99 %8.3fms  max %9.3fms\n",
+           v[3] / 1e6, v[4] / 1e6, h.Max() / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    const char* urlFile = nullptr;
+    static option longOpts[] = {
+        { "threads", required_argument, nullptr, 't' },
+        { "connections", required_argument, nullptr, 'c' },
+        { "duration", required_argument, nullptr, 'd' },
+        { "rate", required_argument, nullptr, 'R' },
+        { "pipeline", required_argument, nullptr, 'p' },
+        { "no-keepalive", no_argument, nullptr, 'K' },
+        { "urls", required_argument, nullptr, 'u' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "t:c:d:R:p:Ku:h", longOpts, nullptr)) != -1) {
+        switch(opt) {
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'R': cfg.rate = atof(optarg); break;
+        case 'p': cfg.pipeline = atoi(optarg); break;
+        case 'K': cfg.keepAlive = false; break;
+        case 'u': urlFile = optarg; break;
+        default: Usage(argv[0]); return 1;
+        }
+    }
+    if(optind >= argc || cfg.threads <= 0 || cfg.conns < cfg.threads || cfg.duration <= 0 || cfg.pipeline <= 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+    if(!cfg.keepAlive) { cfg.pipeline = 1; }
+
+    /* 解析 http://host[:port][/path] */
+    std::string url = argv[optind];
+    if(url.compare(0, 7, "http://") != 0) {
+        fprintf(stderr, "only http:// urls are supported\n");
+        return 1;
+    }
+    std::string rest = url.substr(7);
+    size_t slash = rest.find('/');
+    std::string path = slash == std::string::npos ? "/" : rest.substr(slash);
+    std::string hostport = rest.substr(0, slash);
+    size_t colon = hostport.find(':');
+    cfg.host = hostport.substr(0, colon);
+    if(colon != std::string::npos) { cfg.port = atoi(hostport.c_str() + colon + 1); }
+
+    addrinfo hints = {0}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(cfg.host.c_str(), nullptr, &hints, &res) != 0 || !res) {
+        fprintf(stderr, "cannot resolve %s\n", cfg.host.c_str());
+        return 1;
+    }
+    g_addr = *reinterpret_cast<sockaddr_in*>(res->ai_addr);
+    g_addr.sin_port = htons(cfg.port);
+    freeaddrinfo(res);
+
+    if(urlFile) {
+        if(!LoadUrls(cfg, urlFile)) {
+            fprintf(stderr, "cannot load urls from %s\n", urlFile);
+            return 1;
+        }
+    } else {
+        cfg.requests.push_back(BuildRequest(cfg, path));
+        cfg.weights.push_back(1);
+    }
+
+    printf("Running %ds test @ %s\n", cfg.duration, url.c_str());
+    printf("  %d threads, %d connections, pipeline %d, %s, ", cfg.threads, cfg.conns,
+           cfg.pipeline, cfg.keepAlive ? "keep-alive" : "no keep-alive");
+    if(cfg.rate > 0) { printf("open loop at %.0f req/s\n", cfg.rate); }
+    else { printf("closed loop\n"); }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for(int i = 0; i < cfg.threads; i++) {
+        int conns = cfg.conns / cfg.threads + (i < cfg.conns % cfg.threads ? 1 : 0);
+        workers.emplace_back(new Worker(cfg, conns, cfg.rate / cfg.threads, 12345 + i));
+    }
+    uint64_t start = NowNs();
+    uint64_t end = start + static_cast<uint64_t>(cfg.duration) * 1000000000ULL;
+    std::vector<std::thread> threads;
+    for(auto& w: workers) {
+        threads.emplace_back([&w, end] { w->Run(end); });
+    }
+    for(auto& t: threads) { t.join(); }
+    double elapsed = (NowNs() - start) / 1e9;
+
+    std::unique_ptr<Stats> total(new Stats);
+    for(auto& w: workers) {
+        Stats& s = w->GetStats();
+        total->completed += s.completed;
+        total->non2xx += s.non2xx;
+        total->connectErrors += s.connectErrors;
+        total->ioErrors += s.ioErrors;
+        total->reconnects += s.reconnects;
+        total->bytesIn += s.bytesIn;
+        total->latency.Merge(s.latency);
+        total->service.Merge(s.service);
+    }
+
+    printf("  %llu requests in %.2fs, %.2fMB read\n", (unsigned long long)total->completed,
+           elapsed, total->bytesIn / 1048576.0);
+    printf("Requests/sec: %.2f\n", total->completed / elapsed);
+    printf("Transfer/sec: %.2fMB\n", total->bytesIn / 1048576.0 / elapsed);
+    if(total->non2xx || total->connectErrors || total->ioErrors) {
+        printf("Errors: non-2xx %llu, connect %llu, read/write %llu\n",
+               (unsigned long long)total->non2xx, (unsigned long long)total->connectErrors,
+               (unsigned long long)total->ioErrors);
+    }
+    if(cfg.rate > 0) {
+        PrintHistogram("Latency (corrected, from intended send time):", total->latency);
+        PrintHistogram("Service time (from actual send time):", total->service);
+    } else {
+        PrintHistogram("Latency:", total->service);
+    }
+    return 0;
+}